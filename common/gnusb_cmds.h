@@ -31,11 +31,59 @@
 
 // specific to gnusb matrix
 #define GNUSB_CMD_SETMODE			0xc1
-#define GNUSB_CMD_STORE_PRESET		0xc2
+#define GNUSB_CMD_STORE_PRESET		0xc2		// in, if asked: 1 byte, 0 when there was no room for it, then the preset
 #define GNUSB_CMD_RECALL_PRESET		0xc3
 #define GNUSB_CMD_CLEAR				0xc4
 #define GNUSB_CMD_SET				0xc5
 #define GNUSB_CMD_SET_ALL_MODES		0xc6
+#define GNUSB_CMD_SET_SERIAL		0xc7		// data: up to GNUSB_SERIAL_LEN ascii chars, stalls when it can't be saved now
+#define GNUSB_CMD_SET_DEBOUNCE		0xc8		// value: scans a switch change has to last. in, if asked: 1 byte, 0 when it couldn't be saved now
+#define GNUSB_CMD_COMMIT			0xc9		// save changed button modes to eeprom
+#define GNUSB_CMD_SET_AUTOCOMMIT	0xca		// value: 1 saves mode changes right away (default), 0 waits for COMMIT
+#define GNUSB_CMD_GET_PRESETS		0xcb		// in, 1 byte: number of preset slots, 2 more: free preset bytes (lsb first)
+
+#define GNUSB_CMD_READ_EVENTS		0xcc		// in: status byte, clock, then button events since the last read, oldest first
+#define GNUSB_CMD_POLL_CHANGES		0xcd		// in: the rows changed since generation value, index 1: all rows
+#define GNUSB_CMD_WAIT_CHANGES		0xce		// in: the same, but only once something has changed
+
+// preset slots of firmware that doesn't know GNUSB_CMD_GET_PRESETS
+#define GNUSB_PRESETS_OLD			31
+
+// GNUSB_CMD_READ_EVENTS: the status byte counts the events that follow, the
+// clock is the device time when it answered. both, and the time of each
+// event, are 16 bits, lsb first, in ticks of the matrix scan
+#define GNUSB_EVENTS_MAX			16			// the matrix keeps that many between reads
+#define GNUSB_EVENTS_LOST			0x80		// status: more happened, the oldest are missing
+#define GNUSB_EVENTS_COUNT			0x7f
+#define GNUSB_EVENTS_HEADER			3			// status and clock
+#define GNUSB_EVENT_LEN				3			// the event, its time
+#define GNUSB_TICK_MS				(256. * 64. / 12000.)	// timer 0 overflows at 12MHz / 64: 1.365ms
+// an event: the button in the mode table order (8 * row + column), and the edge
+#define GNUSB_EVENT_PRESS			0x80		// clear on release
+#define GNUSB_EVENT_BUTTON			0x3f
+
+// GNUSB_CMD_POLL_CHANGES: a single 0 if nothing has changed since the host's
+// generation. else a bitmap of the rows that follow (row n = bit n), the
+// current generation (16 bit, lsb first), and those rows in the order of
+// GNUSB_CMD_POLL. firmware that doesn't know it answers with nothing
+#define GNUSB_CHANGES_HEADER		3
+
+// GNUSB_CMD_WAIT_CHANGES: the matrix NAKs until its rows differ from the host's
+// generation, or the timeout in the high byte of index runs out (in scans of
+// the whole matrix, 0 answers right away). the low byte holds flags
+#define GNUSB_WAIT_ALL				0x01		// all rows, right away, like POLL_CHANGES with index 1
+#define GNUSB_WAIT_EVENTS			0x02		// unread button events end the wait too
+#define GNUSB_SCAN_MS				(8 * GNUSB_TICK_MS)	// every row once: 10.9ms
+
+// debounce window: 1 (off) to GNUSB_DEBOUNCE_MAX scans of a row, ca. 11ms each
+#define GNUSB_DEBOUNCE_MAX			7
+
+// serial number string descriptor, tells several matrices apart
+#define GNUSB_SERIAL_LEN			8
+
+// interrupt-in endpoint: the matrix sends its 8 led bytes here whenever they change
+#define GNUSB_INTR_ENDPOINT			1
+#define GNUSB_INTR_INTERVAL			10		// ms, USB_CFG_INTR_POLL_INTERVAL of the firmware
 
 #define BTN_MODE_NONE 		0x00
 #define BTN_MODE_IMPULSE	0x40
@@ -0,0 +1,878 @@
+// ==============================================================================
+// gnusb_device.c
+//
+// Process-wide registry of gnusb devices for the host externals
+//
+// License:
+// The project is built with AVR USB driver by Objective Development, which is
+// published under an own licence based on the GNU General Public License (GPL).
+// gnusb is also distributed under this enhanced licence. See Documentation.
+//
+// ==============================================================================
+
+#include "gnusb_device.h"
+#include "gnusb_cmds.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+#define POLL_TIMEOUT				100		// ms, nothing waits for it anymore
+#define WRITE_TIMEOUT				1000	// ms, mode uploads take a while
+#define MAX_FIND_INTERVAL			20000	// slowest retry when the device is missing
+#define DEFAULT_FIND_INTERVAL		40
+#define WAIT_SCANS					46		// GNUSB_CMD_WAIT_CHANGES answers after 0.5s at the latest
+#define CLOCK_PERIOD				1000	// ms, one clock sample per period: the quickest exchange
+#define CLOCK_DRIFT_SPAN			10000	// ms of samples before the drift is worth estimating
+#define CLOCK_MAX_DRIFT				0.005	// even a ceramic resonator is closer than that
+
+static t_gnusb_device		*devices = NULL;
+static pthread_mutex_t		devices_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void		find_device(t_gnusb_device *d);
+static void		close_device(t_gnusb_device *d);
+
+
+// ==============================================================================
+// Replies
+// ------------------------------------------------------------------------------
+// everything below runs on the device thread with d->lock held, so the client
+// list can't change under our feet. only find_device() and close_device() let
+// go of it while usb blocks: nobody holds on to a client across those. a client
+// that doesn't keep up loses replies
+
+static void reply(t_gnusb_client *c, int type, int request, int value, unsigned char *data, int len)
+{
+	t_gnusb_msg		msg;
+
+	msg.type = type;
+	msg.request = request;
+	msg.value = value;
+	msg.index = 0;
+	msg.len = len;
+	if (len) memcpy(msg.data, data, len);
+	gnusb_queue_push(&c->replies, &msg);
+}
+
+//--------------------------------------------------------------------------
+// snapshots only go to clients that are running or have just banged,
+// everything else to whoever wants the device open
+
+static void broadcast(t_gnusb_device *d, int type, int request, int value, unsigned char *data, int len)
+{
+	t_gnusb_client	*c;
+
+	for (c = d->clients; c; c = c->next) {
+		if (type == GNUSB_MSG_VALUES) {
+			if (!c->interval && !c->poll_once) continue;
+			c->poll_once = 0;
+		} else if (type == GNUSB_MSG_BUTTONS) {
+			if (!c->events) continue;
+		} else {
+			if (type == GNUSB_MSG_NOT_FOUND || type == GNUSB_MSG_CLOSED
+				|| (type == GNUSB_MSG_ERROR && (request == GNUSB_CMD_POLL || request == GNUSB_CMD_POLL_CHANGES)))
+				c->poll_once = 0;						// no snapshot coming, that's the answer to a bang
+			if (!c->active) continue;
+		}
+		reply(c, type, request, value, data, len);
+	}
+}
+
+//--------------------------------------------------------------------------
+// a poll or a query only counts as done once its answer is queued, so the
+// scheduler keeps picking up replies until then (see gnusb_client_busy())
+
+static void settle(t_gnusb_device *d)
+{
+	t_gnusb_client	*c;
+	int				n;
+
+	for (c = d->clients; c; c = c->next) {
+		n = 0;
+		if (c->polls_waiting && !c->poll_once) {
+			n += c->polls_waiting;
+			c->polls_waiting = 0;
+		}
+		if (c->queries_waiting && (int)(d->queries_done - c->query_mark) >= 0) {
+			n += c->queries_waiting;
+			c->queries_waiting = 0;
+		}
+		if (n) {
+			__sync_synchronize();
+			c->io_done += n;
+		}
+	}
+}
+
+//--------------------------------------------------------------------------
+// the host clock: monotonic, the device clock is mapped onto it
+
+static double now_ms(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000. + ts.tv_nsec / 1e6;
+}
+
+
+// ==============================================================================
+// Polling
+// ------------------------------------------------------------------------------
+
+static void got_values(t_gnusb_device *d, unsigned char *buffer)
+{
+	if (d->io_values_valid && !memcmp(d->io_values, buffer, d->poll_len)) return;
+
+	broadcast(d, GNUSB_MSG_VALUES, GNUSB_CMD_POLL, 0, buffer, d->poll_len);
+	memcpy(d->io_values, buffer, d->poll_len);
+	d->io_values_valid = 1;
+}
+
+//--------------------------------------------------------------------------
+// only the rows that changed since the last answer. a lone 0 byte if none,
+// usually. nothing at all from firmware that doesn't know the request
+
+static void got_changes(t_gnusb_device *d, unsigned char *data, int len)
+{
+	unsigned char	*row = data + GNUSB_CHANGES_HEADER;
+	int				i;
+
+	if (data[0]) {
+		for (i = 0; i < 8; i++) {
+			if (!(data[0] & (1 << i))) continue;
+			if (row >= data + len) return;				// cut short: the next answer has them again
+			d->changes_values[i] = *row++;
+		}
+		d->changes_generation = data[1] | (data[2] << 8);
+		d->changes_known = 1;
+	}
+	got_values(d, d->changes_values);
+}
+
+//--------------------------------------------------------------------------
+// a GNUSB_CMD_WAIT_CHANGES keeps endpoint 0 to itself until the matrix
+// answers. anything else for it goes first: the wait gets cancelled, and
+// the device thread starts a new one behind it
+
+static int long_poll(t_gnusb_device *d)
+{
+	return d->use_wait && d->has_wait && !d->intr_claimed;
+}
+
+static void stop_waiting(t_gnusb_device *d)
+{
+	if (!d->wait_pending) return;
+	gnusb_transport_cancel(&d->usb, GNUSB_CMD_WAIT_CHANGES);
+	d->wait_pending = 0;
+}
+
+static void request_wait(t_gnusb_device *d)
+{
+	int		flags = 0;
+
+	if (d->wait_pending || d->poll_pending) return;
+	if (!d->changes_known) flags |= GNUSB_WAIT_ALL;
+	if (d->events_wanted && d->has_events) flags |= GNUSB_WAIT_EVENTS;
+	if (gnusb_transport_control(&d->usb, GNUSB_CMD_WAIT_CHANGES, d->changes_generation, flags | (WAIT_SCANS << 8), NULL,
+								GNUSB_CHANGES_HEADER + 8, 1, (unsigned int)(WAIT_SCANS * GNUSB_SCAN_MS) + POLL_TIMEOUT) == 0)
+		d->wait_pending = 1;
+}
+
+//--------------------------------------------------------------------------
+
+static void request_poll(t_gnusb_device *d)
+{
+	if (d->poll_pending) return;
+	stop_waiting(d);
+	if (d->has_changes) {
+		if (gnusb_transport_control(&d->usb, GNUSB_CMD_POLL_CHANGES, d->changes_generation, !d->changes_known, NULL,
+									GNUSB_CHANGES_HEADER + 8, 1, POLL_TIMEOUT) == 0)
+			d->poll_pending = 1;
+	} else if (gnusb_transport_control(&d->usb, GNUSB_CMD_POLL, 0, 0, NULL, d->poll_len, 1, POLL_TIMEOUT) == 0) {
+		d->poll_pending = 1;
+	}
+}
+
+//--------------------------------------------------------------------------
+// keep one read waiting on the interrupt endpoint, else ask with GNUSB_CMD_POLL
+
+static void request_values(t_gnusb_device *d)
+{
+	if (d->intr_claimed && !d->needs_sync) {
+		if (!d->intr_pending && gnusb_transport_interrupt(&d->usb, GNUSB_INTR_ENDPOINT, d->poll_len, 0) == 0)
+			d->intr_pending = 1;
+	} else if (long_poll(d)) {
+		request_wait(d);
+	} else {
+		request_poll(d);
+	}
+}
+
+//--------------------------------------------------------------------------
+// button events are read along with the values, as long as anybody wants them
+
+static void request_events(t_gnusb_device *d)
+{
+	if (!d->events_wanted || !d->has_events || d->events_pending) return;
+	stop_waiting(d);
+	if (gnusb_transport_control(&d->usb, GNUSB_CMD_READ_EVENTS, 0, 0, NULL,
+									GNUSB_EVENTS_HEADER + GNUSB_EVENTS_MAX * GNUSB_EVENT_LEN, 1, POLL_TIMEOUT) == 0) {
+		d->events_pending = 1;
+		d->events_sent = now_ms();
+	}
+}
+
+//--------------------------------------------------------------------------
+// the device clock has 16 bits and wraps every 90s. the wraps get counted, if
+// it's been a while since the last read, from the host time in between
+
+static unsigned long long device_clock(t_gnusb_device *d, unsigned int now)
+{
+	double			host = now_ms();
+	double			missed;
+	unsigned int	delta = (now - d->clock_last) & 0xffff;
+
+	missed = (host - d->clock_at) / GNUSB_TICK_MS - delta;
+	if (d->clock_at && missed > 32768.) d->clock_ticks += (unsigned long long)((missed + 32768.) / 65536.) << 16;
+	if (d->clock_at) d->clock_ticks += delta;
+	d->clock_last = now;
+	d->clock_at = host;
+	return d->clock_ticks;
+}
+
+//--------------------------------------------------------------------------
+// where the device clock is on the host clock, NTP style: the device read its
+// clock, somewhere between sending the request and getting the answer. every
+// sample bounds the offset from both sides, given the rate. the rate is the
+// nominal one until there are enough seconds of samples to fit the drift
+
+static void clock_estimate(t_gnusb_device *d)
+{
+	t_gnusb_clock_sample	*s, *newest = d->clock_samples + d->clock_newest;
+	t_gnusb_clock_sample	*oldest = d->clock_samples + (d->clock_newest + 1) % d->clock_count;
+	double					rate = GNUSB_TICK_MS;
+	double					t, h, t0, h0, st = 0., sh = 0.;
+	double					lo = -1e300, hi = 1e300;
+	int						i;
+
+	if (newest->sent - oldest->sent >= CLOCK_DRIFT_SPAN) {	// least squares over the midpoints
+		t0 = oldest->ticks;
+		h0 = (oldest->sent + oldest->received) / 2.;
+		for (i = 0, s = d->clock_samples; i < d->clock_count; i++, s++) {
+			st += s->ticks - t0;
+			sh += (s->sent + s->received) / 2. - h0;
+		}
+		st /= d->clock_count;
+		sh /= d->clock_count;
+		for (i = 0, s = d->clock_samples, t0 += st, h0 += sh, st = 0., sh = 0.; i < d->clock_count; i++, s++) {
+			t = s->ticks - t0;
+			h = (s->sent + s->received) / 2. - h0;
+			st += t * t;
+			sh += t * h;
+		}
+		if (st > 0.) rate = sh / st;
+		if (rate < GNUSB_TICK_MS * (1. - CLOCK_MAX_DRIFT)) rate = GNUSB_TICK_MS * (1. - CLOCK_MAX_DRIFT);
+		if (rate > GNUSB_TICK_MS * (1. + CLOCK_MAX_DRIFT)) rate = GNUSB_TICK_MS * (1. + CLOCK_MAX_DRIFT);
+	}
+
+	// it read tick n somewhere in [n, n + 1)
+	for (i = 0, s = d->clock_samples; i < d->clock_count; i++, s++) {
+		if (s->sent - rate * (s->ticks + 1.) > lo) lo = s->sent - rate * (s->ticks + 1.);
+		if (s->received - rate * s->ticks < hi) hi = s->received - rate * s->ticks;
+	}
+	d->clock_rate = rate;
+	d->clock_offset = (lo + hi) / 2.;
+}
+
+//--------------------------------------------------------------------------
+// keep the quickest exchange of every CLOCK_PERIOD, the others say less
+
+static void clock_sample(t_gnusb_device *d, unsigned long long ticks, double sent, double received)
+{
+	t_gnusb_clock_sample	*s = d->clock_samples + d->clock_newest;
+
+	if (!d->clock_count || sent >= d->clock_period) {
+		d->clock_period = sent + CLOCK_PERIOD;
+		d->clock_newest = (d->clock_newest + 1) % GNUSB_CLOCK_SAMPLES;
+		if (d->clock_count < GNUSB_CLOCK_SAMPLES) d->clock_count++;
+		s = d->clock_samples + d->clock_newest;
+	} else if (received - sent >= s->received - s->sent) {
+		return;
+	}
+	s->ticks = (double)ticks;
+	s->sent = sent;
+	s->received = received;
+	clock_estimate(d);
+}
+
+//--------------------------------------------------------------------------
+// hand out the events with their time on the unwrapped clock: they happened
+// before the device answered, that many ticks ago
+
+static void got_events(t_gnusb_device *d, unsigned char *data, int len)
+{
+	unsigned char		buffer[GNUSB_MSG_DATA_LEN];
+	unsigned char		*event;
+	unsigned long long	now;
+	unsigned long long	time;
+	unsigned int		host;
+	int					i, n, lost;
+
+	now = device_clock(d, data[1] | (data[2] << 8));
+	clock_sample(d, now, d->events_sent, d->clock_at);
+	if (d->events_stale) {
+		d->events_stale = 0;
+		return;
+	}
+	n = data[0] & GNUSB_EVENTS_COUNT;
+	if (n > (len - GNUSB_EVENTS_HEADER) / GNUSB_EVENT_LEN) n = (len - GNUSB_EVENTS_HEADER) / GNUSB_EVENT_LEN;
+	lost = (data[0] & GNUSB_EVENTS_LOST) != 0;
+
+	for (i = 0; i < n || lost; ) {
+		for (len = 0; i < n && len + GNUSB_MSG_EVENT_LEN <= GNUSB_MSG_DATA_LEN; i++, len += GNUSB_MSG_EVENT_LEN) {
+			event = data + GNUSB_EVENTS_HEADER + i * GNUSB_EVENT_LEN;
+			time = now - ((d->clock_last - (event[1] | (event[2] << 8))) & 0xffff);
+			host = (unsigned int)(unsigned long long)((d->clock_offset + d->clock_rate * time) * 1000.);
+			buffer[len] = event[0];
+			buffer[len + 1] = time & 0xff;
+			buffer[len + 2] = (time >> 8) & 0xff;
+			buffer[len + 3] = (time >> 16) & 0xff;
+			buffer[len + 4] = (time >> 24) & 0xff;
+			buffer[len + 5] = host & 0xff;
+			buffer[len + 6] = (host >> 8) & 0xff;
+			buffer[len + 7] = (host >> 16) & 0xff;
+			buffer[len + 8] = (host >> 24) & 0xff;
+		}
+		broadcast(d, GNUSB_MSG_BUTTONS, GNUSB_CMD_READ_EVENTS, lost, buffer, len);
+		lost = 0;
+	}
+	if (n == GNUSB_EVENTS_MAX) request_events(d);		// there may be more
+}
+
+//--------------------------------------------------------------------------
+// the fastest client sets the pace
+
+static void update_interval(t_gnusb_device *d)
+{
+	t_gnusb_client	*c;
+	int				interval = 0;
+	int				events = 0;
+
+	for (c = d->clients; c; c = c->next) {
+		if (c->interval && (!interval || c->interval < interval)) interval = c->interval;
+		if (c->events) events = 1;
+	}
+	d->io_interval = interval;
+	d->find_interval = interval;
+	if (events && !d->events_wanted) d->events_stale = 1;
+	d->events_wanted = events;
+}
+
+//--------------------------------------------------------------------------
+
+static int any_active(t_gnusb_device *d)
+{
+	t_gnusb_client	*c;
+
+	for (c = d->clients; c; c = c->next) {
+		if (c->active) return 1;
+	}
+	return 0;
+}
+
+//--------------------------------------------------------------------------
+// libusb calls this on the device thread when a transfer has come back
+
+static void transfer_done(void *owner, int request, int status, unsigned char *data, int len)
+{
+	t_gnusb_device	*d = (t_gnusb_device *)owner;
+
+	pthread_mutex_lock(&d->lock);
+	switch (request) {
+		case GNUSB_REQ_INTERRUPT:
+			d->intr_pending = 0;
+			if (status == LIBUSB_TRANSFER_COMPLETED && len == d->poll_len) {
+				got_values(d, data);
+			} else {
+				broadcast(d, GNUSB_MSG_ERROR, GNUSB_INTR_ENDPOINT, status, NULL, 0);
+				d->intr_claimed = 0;							// older firmware: fall back to polling
+			}
+			if (d->io_interval && !d->usb.lost) request_values(d);
+			break;
+
+		case GNUSB_CMD_POLL:
+			d->poll_pending = 0;
+			if (status == LIBUSB_TRANSFER_COMPLETED && len == d->poll_len) {
+				d->needs_sync = 0;
+				got_values(d, data);
+				if (d->io_interval && d->intr_claimed) request_values(d);
+			} else {
+				broadcast(d, GNUSB_MSG_ERROR, GNUSB_CMD_POLL, status, NULL, 0);
+			}
+			break;
+
+		case GNUSB_CMD_POLL_CHANGES:
+			d->poll_pending = 0;
+			if (status != LIBUSB_TRANSFER_COMPLETED) {
+				broadcast(d, GNUSB_MSG_ERROR, GNUSB_CMD_POLL_CHANGES, status, NULL, 0);
+			} else if (len == 0) {
+				d->has_changes = 0;								// older firmware: poll everything
+				request_poll(d);
+			} else {
+				d->needs_sync = 0;
+				got_changes(d, data, len);
+				if (d->io_interval && d->intr_claimed) request_values(d);
+			}
+			break;
+
+		case GNUSB_CMD_WAIT_CHANGES:
+			d->wait_pending = 0;
+			if (status == LIBUSB_TRANSFER_TIMED_OUT) {
+				;												// nothing changed, or the answer got lost: wait again
+			} else if (status != LIBUSB_TRANSFER_COMPLETED) {
+				broadcast(d, GNUSB_MSG_ERROR, GNUSB_CMD_WAIT_CHANGES, status, NULL, 0);
+				d->has_wait = 0;								// poll instead
+			} else if (len == 0) {
+				d->has_wait = 0;								// older firmware
+			} else {
+				d->needs_sync = 0;
+				got_changes(d, data, len);
+				request_events(d);								// what woke it up, maybe
+			}
+			if (d->io_interval && !d->usb.lost) request_values(d);
+			break;
+
+		case GNUSB_CMD_READ_EVENTS:
+			d->events_pending = 0;
+			if (status != LIBUSB_TRANSFER_COMPLETED) {
+				broadcast(d, GNUSB_MSG_ERROR, GNUSB_CMD_READ_EVENTS, status, NULL, 0);
+			} else if (len < GNUSB_EVENTS_HEADER) {
+				d->has_events = 0;								// older firmware: it doesn't know the request
+			} else {
+				got_events(d, data, len);
+			}
+			break;
+
+		default:
+			if (request & GNUSB_REQ_TAG) d->queries_done++;
+			if (status != LIBUSB_TRANSFER_COMPLETED) broadcast(d, GNUSB_MSG_ERROR, request & 0xff, status, NULL, 0);
+			else if (request & GNUSB_REQ_TAG) broadcast(d, GNUSB_MSG_ANSWER, request & 0xff, 0, data, len);
+			break;
+	}
+	settle(d);
+	pthread_mutex_unlock(&d->lock);
+}
+
+
+// ==============================================================================
+// The device thread
+// ------------------------------------------------------------------------------
+// everything that touches libusb happens here, so a slow or unplugged device
+// never holds up the scheduler. transfers are asynchronous: a poll, an
+// interrupt read and any number of writes can be in flight at the same time
+
+// -> 0 if the command is only done once its answer is in, see settle().
+// the device gets opened in between commands, see find_wanted()
+
+static int do_command(t_gnusb_device *d, t_gnusb_client *c, t_gnusb_msg *msg)
+{
+	int				err;
+
+	switch (msg->type) {
+		case GNUSB_MSG_OPEN:
+			c->active = 1;
+			if (!d->usb.handle) d->find_wanted = 1;
+			else reply(c, GNUSB_MSG_FOUND, 0, 0, (unsigned char *)d->usb.serial, strlen(d->usb.serial) + 1);
+			break;
+
+		case GNUSB_MSG_CLOSE:
+			reply(c, GNUSB_MSG_CLOSED, 0, (c->active && d->usb.handle != NULL), NULL, 0);
+			c->active = 0;								// the device closes once nobody needs it
+			break;
+
+		case GNUSB_MSG_POLL:
+			c->active = 1;
+			c->poll_once = 1;
+			if (!d->usb.handle) d->find_wanted = 1;
+			else {
+				d->io_values_valid = 0;					// bang always outputs what has changed
+				request_poll(d);
+				request_events(d);
+			}
+			c->polls_waiting++;
+			return 0;
+
+		case GNUSB_MSG_EVENTS:
+			c->events = msg->value;
+			update_interval(d);
+			break;
+
+		case GNUSB_MSG_INTERVAL:
+			c->interval = msg->value;
+			if (c->interval) c->active = 1;
+			update_interval(d);
+			if (d->io_interval && d->usb.handle) request_values(d);
+			break;
+
+		case GNUSB_MSG_WAIT:
+			d->use_wait = msg->value;
+			if (!d->use_wait) stop_waiting(d);
+			break;
+
+		case GNUSB_MSG_INTERRUPT:
+			d->use_interrupt = msg->value;
+			if (d->usb.handle) d->find_wanted = 2;		// reopen to claim or release the interface
+			break;
+
+		case GNUSB_MSG_CONTROL:
+			c->active = 1;
+			if (!d->usb.handle) d->find_wanted = 1;
+			else {
+				stop_waiting(d);
+				err = gnusb_transport_control(&d->usb, msg->request, msg->value, msg->index,
+												msg->data, msg->len, (msg->len == 0), WRITE_TIMEOUT);
+				if (err < 0) reply(c, GNUSB_MSG_ERROR, msg->request, err, NULL, 0);
+			}
+			break;
+
+		case GNUSB_MSG_QUERY:							// the answer goes to every client
+			c->active = 1;
+			if (!d->usb.handle) d->find_wanted = 1;
+			else {
+				stop_waiting(d);
+				err = gnusb_transport_control(&d->usb, msg->request | GNUSB_REQ_TAG, msg->value, msg->index,
+												NULL, msg->len, 1, WRITE_TIMEOUT);
+				if (err < 0) reply(c, GNUSB_MSG_ERROR, msg->request, err, NULL, 0);
+				else {
+					c->query_mark = ++d->queries_sent;
+					c->queries_waiting++;
+					return 0;
+				}
+			}
+			break;
+	}
+	return 1;
+}
+
+//--------------------------------------------------------------------------
+
+static void find_wanted(t_gnusb_device *d)
+{
+	if (d->find_wanted == 2 && d->usb.handle) close_device(d);
+	d->find_wanted = 0;
+	if (!d->usb.handle) find_device(d);
+}
+
+//--------------------------------------------------------------------------
+
+static void *device_thread(void *arg)
+{
+	t_gnusb_device	*d = (t_gnusb_device *)arg;
+	t_gnusb_client	*c;
+	t_gnusb_msg		msg;
+	double			next_poll = 0.;
+	double			now;
+	int				timeout;
+	char			buf[16];
+
+	while (!d->quit) {
+		// sleep until there is a command, a transfer has come back or the next poll is due
+		now = now_ms();
+		timeout = -1;
+		if (d->io_interval) timeout = (next_poll > now) ? (int)(next_poll - now) + 1 : 0;
+		if (gnusb_transport_wait(&d->usb, d->wake_pipe[0], timeout))
+			(void)read(d->wake_pipe[0], buf, sizeof(buf));
+
+		pthread_mutex_lock(&d->lock);
+
+		if (d->usb.lost) {									// unplugged: look for it again on the next poll
+			close_device(d);
+			broadcast(d, GNUSB_MSG_CLOSED, 0, 1, NULL, 0);
+		}
+
+		c = d->clients;
+		while (c) {
+			if (d->find_wanted) {							// lets go of the lock: clients may have come and gone
+				find_wanted(d);
+				c = d->clients;
+			} else if (!gnusb_queue_pop(&c->commands, &msg)) {
+				c = c->next;
+			} else if (do_command(d, c, &msg)) {
+				__sync_synchronize();
+				c->io_done++;
+			}
+		}
+		if (d->usb.handle && !any_active(d)) close_device(d);
+
+		if (d->io_interval) {
+			now = now_ms();
+			if (!d->usb.handle && d->usb.arrived) {			// hotplug: go and see right away
+				find_device(d);
+			} else if (now >= next_poll) {
+				next_poll = now + d->io_interval;
+				if (d->usb.handle) {
+					request_values(d);
+					if (!long_poll(d) || d->events_stale) request_events(d);	// else the wait tells when there are new ones
+				} else if (!d->usb.hotplug || d->usb.rescan) {	// with hotplug there is nothing to look for
+					find_device(d);
+					if (!d->usb.handle) {
+						next_poll = now + d->find_interval;
+						// throttle polling down to max 20s if we can't find the device
+						if (d->find_interval < MAX_FIND_INTERVAL / 2) d->find_interval *= 2;
+					}
+				}
+			}
+			if (d->usb.handle && long_poll(d)) request_wait(d);	// again, after whatever went before it
+		}
+		settle(d);
+
+		pthread_mutex_unlock(&d->lock);
+	}
+
+	pthread_mutex_lock(&d->lock);
+	close_device(d);
+	pthread_mutex_unlock(&d->lock);
+	return NULL;
+}
+
+//--------------------------------------------------------------------------
+
+// opening asks every candidate for its strings, closing waits for the cancelled
+// transfers: both without the lock, so attach and detach never wait on usb.
+// d->usb is ours alone anyway
+
+static void find_device(t_gnusb_device *d)
+{
+	int		found;
+
+	pthread_mutex_unlock(&d->lock);
+	found = gnusb_transport_open(&d->usb, d->product, d->serial, d->index, d->use_interrupt);
+	pthread_mutex_lock(&d->lock);
+
+	if (!found) {
+		broadcast(d, GNUSB_MSG_NOT_FOUND, 0, 0, NULL, 0);
+	} else {
+		broadcast(d, GNUSB_MSG_FOUND, 0, 0, (unsigned char *)d->usb.serial, strlen(d->usb.serial) + 1);
+		d->find_interval = d->io_interval;			// restore original polling interval
+		d->intr_claimed = d->usb.claimed;
+		d->needs_sync = 1;
+		d->io_values_valid = 0;
+		d->has_events = 1;							// until it turns out otherwise
+		d->has_changes = (d->poll_len <= 8);		// one bit per row
+		d->has_wait = d->has_changes;
+		d->changes_known = 0;
+		d->events_stale = 1;
+		d->clock_ticks = 0;
+		d->clock_at = 0.;
+		d->clock_count = 0;							// a new clock, a new estimate
+		d->clock_newest = GNUSB_CLOCK_SAMPLES - 1;
+		request_values(d);							// the first answer is always a full poll
+	}
+}
+
+//--------------------------------------------------------------------------
+
+static void close_device(t_gnusb_device *d)
+{
+	pthread_mutex_unlock(&d->lock);
+	gnusb_transport_close(&d->usb);					// cancels whatever is in flight
+	pthread_mutex_lock(&d->lock);
+	d->intr_claimed = 0;
+	d->poll_pending = 0;
+	d->intr_pending = 0;
+	d->events_pending = 0;
+	d->wait_pending = 0;
+}
+
+
+// ==============================================================================
+// Registry
+// ------------------------------------------------------------------------------
+
+static t_gnusb_device *device_new(const char *product, const char *serial, int index, int poll_len, int use_interrupt)
+{
+	t_gnusb_device		*d;
+	pthread_mutexattr_t	attr;
+
+	d = (t_gnusb_device *)calloc(1, sizeof(t_gnusb_device));
+	if (!d) return NULL;
+
+	strncpy(d->product, product, sizeof(d->product) - 1);
+	if (serial) strncpy(d->serial, serial, sizeof(d->serial) - 1);
+	d->index = index;
+	d->poll_len = (poll_len < GNUSB_MSG_DATA_LEN) ? poll_len : GNUSB_MSG_DATA_LEN;
+	d->use_interrupt = use_interrupt;
+	d->use_wait = 1;
+	d->find_interval = DEFAULT_FIND_INTERVAL;
+
+	// recursive, so a transfer callback never waits on the thread that runs it
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&d->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+
+	if (!gnusb_transport_init(&d->usb, transfer_done, d)) goto fail;
+	if (pipe(d->wake_pipe) != 0) goto fail_usb;
+	fcntl(d->wake_pipe[1], F_SETFL, O_NONBLOCK);			// never block the scheduler on a full pipe
+	if (pthread_create(&d->thread, NULL, device_thread, d) != 0) goto fail_pipe;
+	return d;
+
+fail_pipe:
+	close(d->wake_pipe[0]);
+	close(d->wake_pipe[1]);
+fail_usb:
+	gnusb_transport_exit(&d->usb);
+fail:
+	pthread_mutex_destroy(&d->lock);
+	free(d);
+	return NULL;
+}
+
+//--------------------------------------------------------------------------
+
+static void device_free(t_gnusb_device *d)
+{
+	char	c = 0;
+
+	d->quit = 1;
+	(void)write(d->wake_pipe[1], &c, 1);
+	pthread_join(d->thread, NULL);					// closes the device on its way out
+	close(d->wake_pipe[0]);
+	close(d->wake_pipe[1]);
+	gnusb_transport_exit(&d->usb);
+	pthread_mutex_destroy(&d->lock);
+	free(d);
+}
+
+//--------------------------------------------------------------------------
+
+int gnusb_client_attach(t_gnusb_client *c, const char *product, const char *serial, int index,
+							int poll_len, int use_interrupt)
+{
+	t_gnusb_device	*d;
+
+	if (!serial) serial = "";
+	if (*serial) index = 0;
+
+	gnusb_queue_init(&c->commands);
+	gnusb_queue_init(&c->replies);
+	c->io_sent = 0;
+	c->io_done = 0;
+	c->active = 0;
+	c->interval = 0;
+	c->poll_once = 0;
+	c->polls_waiting = 0;
+	c->queries_waiting = 0;
+	c->query_mark = 0;
+	c->events = 0;
+
+	pthread_mutex_lock(&devices_lock);
+	for (d = devices; d; d = d->next) {
+		if (!strcmp(d->product, product) && !strcmp(d->serial, serial) && d->index == index) break;
+	}
+	if (!d) {
+		d = device_new(product, serial, index, poll_len, use_interrupt);
+		if (d) {
+			d->next = devices;
+			devices = d;
+		}
+	}
+	if (d) {
+		pthread_mutex_lock(&d->lock);
+		c->next = d->clients;
+		d->clients = c;
+		d->refs++;
+		pthread_mutex_unlock(&d->lock);
+	}
+	pthread_mutex_unlock(&devices_lock);
+
+	c->device = d;
+	return (d != NULL);
+}
+
+//--------------------------------------------------------------------------
+
+void gnusb_client_detach(t_gnusb_client *c)
+{
+	t_gnusb_device	*d = c->device;
+	t_gnusb_device	**dp;
+	t_gnusb_client	**cp;
+	char			wake = 0;
+
+	if (!d) return;
+	c->device = NULL;
+
+	pthread_mutex_lock(&devices_lock);
+	pthread_mutex_lock(&d->lock);
+	for (cp = &d->clients; *cp; cp = &(*cp)->next) {
+		if (*cp == c) {
+			*cp = c->next;
+			break;
+		}
+	}
+	d->refs--;
+	if (d->refs) {
+		update_interval(d);
+		(void)write(d->wake_pipe[1], &wake, 1);		// it closes if nobody else is active
+	}
+	pthread_mutex_unlock(&d->lock);
+
+	if (!d->refs) {
+		for (dp = &devices; *dp; dp = &(*dp)->next) {
+			if (*dp == d) {
+				*dp = d->next;
+				break;
+			}
+		}
+	}
+	pthread_mutex_unlock(&devices_lock);
+
+	if (!d->refs) device_free(d);
+}
+
+//--------------------------------------------------------------------------
+
+int gnusb_client_send(t_gnusb_client *c, int type, int request, int value, int index, unsigned char *data, int len)
+{
+	t_gnusb_msg		msg;
+	char			wake = 0;
+
+	if (!c->device) return 0;
+	if (len > GNUSB_MSG_DATA_LEN) len = GNUSB_MSG_DATA_LEN;
+
+	msg.type = type;
+	msg.request = request;
+	msg.value = value;
+	msg.index = index;
+	msg.len = len;
+	if (len && data) memcpy(msg.data, data, len);		// a query has a len but no data
+
+	if (!gnusb_queue_push(&c->commands, &msg)) return 0;
+	c->io_sent++;
+	(void)write(c->device->wake_pipe[1], &wake, 1);
+	return 1;
+}
+
+//--------------------------------------------------------------------------
+
+int gnusb_client_busy(t_gnusb_client *c)
+{
+	unsigned int	done = c->io_done;
+
+	__sync_synchronize();							// replies are queued before io_done moves
+	return (done != c->io_sent);
+}
+
+//--------------------------------------------------------------------------
+// the host time wraps every 71 minutes, the event is only seconds old
+
+double gnusb_client_event_age(const unsigned char *event)
+{
+	unsigned int	host = event[5] | (event[6] << 8) | (event[7] << 16) | ((unsigned int)event[8] << 24);
+	unsigned int	now = (unsigned int)(unsigned long long)(now_ms() * 1000.);
+
+	return (int)(now - host) / 1000.;
+}
@@ -0,0 +1,139 @@
+// ==============================================================================
+// gnusb_device.h
+//
+// Process-wide registry of gnusb devices for the host externals.
+// Every physical device gets one usb thread with one connection and one poll
+// loop, no matter how many objects in the patch talk to it. Objects attach a
+// client to it: their commands go to the device thread through the client's
+// command queue, and the device fans its replies out to every client.
+// The device is closed and its thread ended when the last client detaches.
+//
+// License:
+// The project is built with AVR USB driver by Objective Development, which is
+// published under an own licence based on the GNU General Public License (GPL).
+// gnusb is also distributed under this enhanced licence. See Documentation.
+//
+// ==============================================================================
+
+#ifndef __gnusb_device_h_included__
+#define __gnusb_device_h_included__
+
+#include "gnusb_queue.h"
+#include "gnusb_transport.h"
+
+#include <pthread.h>
+
+#define GNUSB_CLOCK_SAMPLES		32		// exchanges the device clock estimate is fitted to
+
+typedef struct _gnusb_device t_gnusb_device;
+
+// one GNUSB_CMD_READ_EVENTS: the device read its clock somewhere in between
+typedef struct _gnusb_clock_sample
+{
+	double					ticks;			// device clock, unwrapped
+	double					sent;			// host ms when the request went out
+	double					received;		// and when the answer came back
+} t_gnusb_clock_sample;
+
+typedef struct _gnusb_client
+{
+	t_gnusb_queue			commands;		// scheduler -> device thread
+	t_gnusb_queue			replies;		// device thread -> scheduler
+	unsigned int			io_sent;		// commands handed to the device thread
+	volatile unsigned int	io_done;		// commands the device thread has finished, polls and queries once answered
+	t_gnusb_device			*device;		// NULL if attaching failed
+	struct _gnusb_client	*next;
+											// -- owned by the device thread
+	int						active;			// wants the device open
+	int						interval;		// poll interval this client asked for, 0 -> not running
+	int						poll_once;		// banged: gets the next snapshot even if not running
+	int						polls_waiting;	// GNUSB_MSG_POLLs not in io_done until that snapshot is queued
+	int						queries_waiting;	// GNUSB_MSG_QUERYs not in io_done until they are answered
+	unsigned int			query_mark;		// queries_sent of the device after the last one
+	int						events;			// wants GNUSB_MSG_BUTTONS
+} t_gnusb_client;
+
+struct _gnusb_device
+{
+	char					product[32];	// what we're looking for...
+	char					serial[GNUSB_MAX_SERIAL];
+	int						index;
+	int						poll_len;		// bytes in a GNUSB_CMD_POLL answer / interrupt report
+	int						refs;			// attached clients
+	t_gnusb_device			*next;			// in the registry
+
+	pthread_t				thread;
+	pthread_mutex_t			lock;			// guards the client list, never held while usb blocks
+	int						wake_pipe[2];	// kicks the device thread when there are new commands
+	volatile int			quit;
+	t_gnusb_client			*clients;
+											// -- owned by the device thread
+	t_gnusb_transport		usb;
+	int						find_wanted;	// commands want the device: 1 open it, 2 reopen it
+	int						use_interrupt;	// read change reports from the interrupt endpoint instead of polling
+	int						use_wait;		// else keep a GNUSB_CMD_WAIT_CHANGES in flight instead of polling
+	int						intr_claimed;	// interface claimed, interrupt endpoint usable
+	int						needs_sync;		// do a full poll before trusting the interrupt endpoint
+	int						poll_pending;	// a GNUSB_CMD_POLL is in flight
+	int						has_changes;	// the firmware knows GNUSB_CMD_POLL_CHANGES
+	int						has_wait;		// and GNUSB_CMD_WAIT_CHANGES
+	int						wait_pending;	// one is in flight
+	int						changes_known;	// changes_values are right as of changes_generation
+	unsigned int			changes_generation;
+	unsigned char			changes_values[8];	// the device state then
+	int						intr_pending;	// an interrupt read is in flight
+	int						events_wanted;	// some client wants button events
+	int						events_pending;	// a GNUSB_CMD_READ_EVENTS is in flight
+	int						events_stale;	// the next events are from before anybody listened
+	int						has_events;		// the firmware knows GNUSB_CMD_READ_EVENTS
+	unsigned long long		clock_ticks;	// device clock without the wraps, 0 when it was found
+	unsigned int			clock_last;		// its 16 bits as the device sent them last time
+	double					clock_at;		// host time then, in ms
+	double					events_sent;	// host time the GNUSB_CMD_READ_EVENTS in flight went out
+	t_gnusb_clock_sample	clock_samples[GNUSB_CLOCK_SAMPLES];	// the best exchange of every second, a ring
+	int						clock_count;	// samples in there
+	int						clock_newest;	// index of the newest one
+	double					clock_period;	// host time the newest one stops taking better ones
+	double					clock_rate;		// host ms per device tick
+	double					clock_offset;	// host ms at device tick 0
+	unsigned int			queries_sent;	// GNUSB_MSG_QUERY transfers submitted, they come back in order
+	unsigned int			queries_done;	// and come back
+	int						io_interval;	// fastest interval any client asked for, 0 -> only poll on bang
+	int						find_interval;	// retry interval while the device is missing
+	unsigned char			io_values[GNUSB_MSG_DATA_LEN];	// last snapshot handed to the clients
+	int						io_values_valid;
+};
+
+
+// ------------------------------------------------------------------------------
+// - attach to the device with this product name and serial number (or index),
+// starting it up if nobody uses it yet. returns 0 if that failed
+// ------------------------------------------------------------------------------
+extern int		gnusb_client_attach		(t_gnusb_client *c, const char *product, const char *serial, int index,
+											int poll_len, int use_interrupt);
+
+// ------------------------------------------------------------------------------
+// - detach, the last one out closes the device
+// ------------------------------------------------------------------------------
+extern void		gnusb_client_detach		(t_gnusb_client *c);
+
+// ------------------------------------------------------------------------------
+// - scheduler side: queue a command (GNUSB_MSG_...), returns 0 if it was dropped
+// a GNUSB_MSG_QUERY has no data, len is how much to read
+// ------------------------------------------------------------------------------
+extern int		gnusb_client_send		(t_gnusb_client *c, int type, int request, int value, int index,
+											unsigned char *data, int len);
+
+// ------------------------------------------------------------------------------
+// - scheduler side: is the device thread still working on our commands, or
+// waiting for the answer to a poll or a query? keep picking up replies until not
+// ------------------------------------------------------------------------------
+extern int		gnusb_client_busy		(t_gnusb_client *c);
+
+// ------------------------------------------------------------------------------
+// - scheduler side: ms since a button event of a GNUSB_MSG_BUTTONS reply
+// happened, on the host clock. event points at its entry
+// ------------------------------------------------------------------------------
+extern double	gnusb_client_event_age	(const unsigned char *event);
+
+#endif /* __gnusb_device_h_included__ */
@@ -0,0 +1,103 @@
+// ==============================================================================
+// gnusb_queue.h
+//
+// Lock-free single producer / single consumer queue used by the host externals
+// to talk to their usb thread: commands go in on the scheduler thread and come
+// out on the usb thread, replies travel the other way in a second queue.
+//
+// License:
+// The project is built with AVR USB driver by Objective Development, which is
+// published under an own licence based on the GNU General Public License (GPL).
+// gnusb is also distributed under this enhanced licence. See Documentation.
+//
+// ==============================================================================
+
+#ifndef __gnusb_queue_h_included__
+#define __gnusb_queue_h_included__
+
+#define GNUSB_QUEUE_SIZE		64		// messages per queue, must be a power of 2
+#define GNUSB_MSG_DATA_LEN		64		// largest payload: the button mode table
+
+// ------------------------------------------------------------------------------
+// commands: scheduler -> usb thread
+#define GNUSB_MSG_OPEN			1		// look for the device
+#define GNUSB_MSG_CLOSE			2		// close the connection
+#define GNUSB_MSG_POLL			3		// read the current values once
+#define GNUSB_MSG_INTERVAL		4		// poll every value ms, 0 stops
+#define GNUSB_MSG_CONTROL		5		// vendor request: request, value, index, data
+#define GNUSB_MSG_INTERRUPT		6		// value = 1 -> use the interrupt endpoint if there is one
+#define GNUSB_MSG_QUERY			7		// vendor request reading len bytes: request, value, index
+#define GNUSB_MSG_EVENTS		8		// value = 1 -> read button events as well, see GNUSB_CMD_READ_EVENTS
+#define GNUSB_MSG_WAIT			9		// value = 1 (default) -> without the interrupt endpoint, wait for changes instead of polling
+
+// replies: usb thread -> scheduler
+#define GNUSB_MSG_VALUES		16		// data holds a fresh snapshot
+#define GNUSB_MSG_FOUND			17		// device opened
+#define GNUSB_MSG_NOT_FOUND		18		// no device found
+#define GNUSB_MSG_CLOSED		19		// value = 1 if there was an open connection
+#define GNUSB_MSG_ERROR			20		// transfer failed, value = libusb result
+#define GNUSB_MSG_ANSWER		21		// data holds what a query for request has read
+#define GNUSB_MSG_BUTTONS		22		// data holds button events, oldest first. value = 1 if some got lost before
+
+// GNUSB_MSG_BUTTONS: the event byte, then its device time in GNUSB_TICK_MS since
+// the device was found, then the same moment on the host clock in usec, wrapping.
+// both 32 bit lsb first, see gnusb_client_event_age() for the host time
+#define GNUSB_MSG_EVENT_LEN		9
+
+typedef struct _gnusb_msg
+{
+	int				type;
+	int				request;
+	int				value;
+	int				index;
+	int				len;
+	unsigned char	data[GNUSB_MSG_DATA_LEN];
+} t_gnusb_msg;
+
+typedef struct _gnusb_queue
+{
+	volatile unsigned int	head;		// only written by the producer
+	volatile unsigned int	tail;		// only written by the consumer
+	t_gnusb_msg				msgs[GNUSB_QUEUE_SIZE];
+} t_gnusb_queue;
+
+
+// ------------------------------------------------------------------------------
+// - gnusb_queue_init
+// ------------------------------------------------------------------------------
+static __inline__ void gnusb_queue_init(t_gnusb_queue *q)
+{
+	q->head = 0;
+	q->tail = 0;
+}
+
+// ------------------------------------------------------------------------------
+// - gnusb_queue_push	-> returns 0 if the queue is full
+// ------------------------------------------------------------------------------
+static __inline__ int gnusb_queue_push(t_gnusb_queue *q, const t_gnusb_msg *m)
+{
+	unsigned int head = q->head;
+
+	if (head - q->tail >= GNUSB_QUEUE_SIZE) return 0;
+	q->msgs[head & (GNUSB_QUEUE_SIZE - 1)] = *m;
+	__sync_synchronize();						// message must be visible before the index moves
+	q->head = head + 1;
+	return 1;
+}
+
+// ------------------------------------------------------------------------------
+// - gnusb_queue_pop		-> returns 0 if the queue is empty
+// ------------------------------------------------------------------------------
+static __inline__ int gnusb_queue_pop(t_gnusb_queue *q, t_gnusb_msg *m)
+{
+	unsigned int tail = q->tail;
+
+	if (q->head == tail) return 0;
+	__sync_synchronize();						// don't read the message before seeing the index
+	*m = q->msgs[tail & (GNUSB_QUEUE_SIZE - 1)];
+	__sync_synchronize();						// done reading before the slot is handed back
+	q->tail = tail + 1;
+	return 1;
+}
+
+#endif /* __gnusb_queue_h_included__ */
@@ -0,0 +1,488 @@
+// ==============================================================================
+// gnusb_transport.c
+//
+// Asynchronous usb transport for the host externals, built on libusb-1.0
+//
+// License:
+// The project is built with AVR USB driver by Objective Development, which is
+// published under an own licence based on the GNU General Public License (GPL).
+// gnusb is also distributed under this enhanced licence. See Documentation.
+//
+// ==============================================================================
+
+#include "gnusb_transport.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <pthread.h>
+
+struct _gnusb_transfer
+{
+	struct libusb_transfer	*xfer;
+	t_gnusb_transport		*t;
+	int						request;
+	int						is_control;
+	int						cancelled;		// by gnusb_transport_cancel(), the owner doesn't want it back
+	t_gnusb_transfer		*prev;
+	t_gnusb_transfer		*next;
+	unsigned char			buffer[1];		// setup packet and data follow here
+};
+
+// what a device at a given place on the bus told us about itself
+typedef struct _gnusb_identity
+{
+	int						used;
+	unsigned char			bus;
+	unsigned char			address;		// changes whenever the device re-enumerates
+	unsigned char			depth;
+	unsigned char			ports[GNUSB_MAX_PORTS];
+	char					vendor[64];
+	char					product[64];
+	char					serial[GNUSB_MAX_SERIAL];
+} t_gnusb_identity;
+
+// shared by all objects: a second instance or a reconnect doesn't ask again
+static t_gnusb_identity		identities[GNUSB_MAX_IDENTITIES];
+static pthread_mutex_t		identities_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+// ==============================================================================
+// Transfers
+// ------------------------------------------------------------------------------
+
+static void unlink_transfer(t_gnusb_transfer *tr)
+{
+	if (tr->prev) tr->prev->next = tr->next;
+	else tr->t->transfers = tr->next;
+	if (tr->next) tr->next->prev = tr->prev;
+}
+
+//--------------------------------------------------------------------------
+// libusb calls this from libusb_handle_events_timeout(), ie. from gnusb_transport_wait()
+
+static void transfer_callback(struct libusb_transfer *xfer)
+{
+	t_gnusb_transfer	*tr = (t_gnusb_transfer *)xfer->user_data;
+	t_gnusb_transport	*t = tr->t;
+	unsigned char		*data;
+
+	unlink_transfer(tr);
+	t->in_flight--;
+
+	if (xfer->status == LIBUSB_TRANSFER_NO_DEVICE) t->lost = 1;
+	if (xfer->status == LIBUSB_TRANSFER_CANCELLED && (tr->cancelled || t->closing)) {
+		;												// nobody waits for it anymore
+	} else if (t->done) {
+		data = tr->is_control ? libusb_control_transfer_get_data(xfer) : xfer->buffer;
+		t->done(t->owner, tr->request, xfer->status, data, xfer->actual_length);
+	}
+
+	libusb_free_transfer(xfer);
+	free(tr);
+}
+
+//--------------------------------------------------------------------------
+
+static t_gnusb_transfer *new_transfer(t_gnusb_transport *t, int request, int len)
+{
+	t_gnusb_transfer	*tr;
+
+	tr = (t_gnusb_transfer *)malloc(sizeof(t_gnusb_transfer) + LIBUSB_CONTROL_SETUP_SIZE + len);
+	if (!tr) return NULL;
+	tr->xfer = libusb_alloc_transfer(0);
+	if (!tr->xfer) {
+		free(tr);
+		return NULL;
+	}
+	tr->t = t;
+	tr->request = request;
+	tr->cancelled = 0;
+	return tr;
+}
+
+//--------------------------------------------------------------------------
+
+static int submit_transfer(t_gnusb_transfer *tr)
+{
+	t_gnusb_transport	*t = tr->t;
+	int					err;
+
+	err = libusb_submit_transfer(tr->xfer);
+	if (err < 0) {
+		if (err == LIBUSB_ERROR_NO_DEVICE) t->lost = 1;
+		libusb_free_transfer(tr->xfer);
+		free(tr);
+		return err;
+	}
+	tr->prev = NULL;
+	tr->next = t->transfers;
+	if (t->transfers) t->transfers->prev = tr;
+	t->transfers = tr;
+	t->in_flight++;
+	return 0;
+}
+
+//--------------------------------------------------------------------------
+
+int gnusb_transport_control(t_gnusb_transport *t, int request, int value, int index,
+								unsigned char *data, int len, int in, unsigned int timeout)
+{
+	t_gnusb_transfer	*tr;
+
+	if (!t->handle || t->closing) return LIBUSB_ERROR_NO_DEVICE;
+	tr = new_transfer(t, request, len);
+	if (!tr) return LIBUSB_ERROR_NO_MEM;
+
+	tr->is_control = 1;
+	libusb_fill_control_setup(tr->buffer,
+		LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE | (in ? LIBUSB_ENDPOINT_IN : LIBUSB_ENDPOINT_OUT),
+		request & 0xff, value, index, len);
+	if (!in && len) memcpy(tr->buffer + LIBUSB_CONTROL_SETUP_SIZE, data, len);
+	libusb_fill_control_transfer(tr->xfer, t->handle, tr->buffer, transfer_callback, tr, timeout);
+
+	return submit_transfer(tr);
+}
+
+//--------------------------------------------------------------------------
+
+int gnusb_transport_interrupt(t_gnusb_transport *t, int endpoint, int len, unsigned int timeout)
+{
+	t_gnusb_transfer	*tr;
+
+	if (!t->handle || t->closing) return LIBUSB_ERROR_NO_DEVICE;
+	if (!t->claimed) return LIBUSB_ERROR_ACCESS;
+	tr = new_transfer(t, GNUSB_REQ_INTERRUPT, len);
+	if (!tr) return LIBUSB_ERROR_NO_MEM;
+
+	tr->is_control = 0;
+	libusb_fill_interrupt_transfer(tr->xfer, t->handle, LIBUSB_ENDPOINT_IN | endpoint,
+									tr->buffer, len, transfer_callback, tr, timeout);
+
+	return submit_transfer(tr);
+}
+
+//--------------------------------------------------------------------------
+// the owner doesn't hear from the transfers it cancelled. some systems abort
+// everything else on endpoint 0 along with a control transfer: those come back
+// as LIBUSB_TRANSFER_CANCELLED, so every other request still gets its answer
+
+int gnusb_transport_cancel(t_gnusb_transport *t, int request)
+{
+	t_gnusb_transfer	*tr;
+	int					n = 0;
+
+	for (tr = t->transfers; tr; tr = tr->next) {
+		if (tr->request != request || tr->cancelled) continue;
+		if (libusb_cancel_transfer(tr->xfer) != 0) continue;		// too late, it's done
+		tr->cancelled = 1;
+		n++;
+	}
+	return n;
+}
+
+
+// ==============================================================================
+// Identity cache
+// ------------------------------------------------------------------------------
+// reading string descriptors means blocking control transfers on every candidate,
+// and there are lots of other obdev shared-pid devices out there. so we remember
+// the strings by bus path and only ask again when the topology has changed.
+// a match needs the same device address too, it's new after every
+// re-enumeration: the cache outlives the contexts that see departures, and
+// another device plugged into the same port must never pass for the old one.
+// with hotplug, a departure forgets the entry right away as well
+
+static void identity_location(libusb_device *device, t_gnusb_identity *id)
+{
+	int		n;
+
+	id->bus = libusb_get_bus_number(device);
+	id->address = libusb_get_device_address(device);
+	n = libusb_get_port_numbers(device, id->ports, GNUSB_MAX_PORTS);
+	id->depth = (n > 0) ? n : 0;
+}
+
+//--------------------------------------------------------------------------
+// call with identities_lock held
+
+static t_gnusb_identity *identity_find(t_gnusb_identity *where)
+{
+	int		i;
+
+	for (i = 0; i < GNUSB_MAX_IDENTITIES; i++) {
+		if (identities[i].used && identities[i].bus == where->bus && identities[i].depth == where->depth
+			&& !memcmp(identities[i].ports, where->ports, where->depth))
+			return &identities[i];
+	}
+	return NULL;
+}
+
+//--------------------------------------------------------------------------
+// -> returns 1 and fills in the strings if we know the device
+
+static int identity_lookup(libusb_device *device, t_gnusb_identity *id)
+{
+	t_gnusb_identity	*known;
+	int					found = 0;
+
+	identity_location(device, id);
+	if (!id->depth) return 0;							// no port path on this platform, can't tell
+
+	pthread_mutex_lock(&identities_lock);
+	known = identity_find(id);
+	if (known && known->address == id->address) {
+		*id = *known;
+		found = 1;
+	}
+	pthread_mutex_unlock(&identities_lock);
+	return found;
+}
+
+//--------------------------------------------------------------------------
+
+static void identity_store(t_gnusb_identity *id)
+{
+	t_gnusb_identity	*slot;
+	int					i;
+
+	if (!id->depth) return;
+
+	pthread_mutex_lock(&identities_lock);
+	slot = identity_find(id);
+	for (i = 0; !slot && i < GNUSB_MAX_IDENTITIES; i++) {
+		if (!identities[i].used) slot = &identities[i];
+	}
+	if (!slot) slot = &identities[id->address % GNUSB_MAX_IDENTITIES];	// full: evict something
+	*slot = *id;
+	slot->used = 1;
+	pthread_mutex_unlock(&identities_lock);
+}
+
+//--------------------------------------------------------------------------
+
+static void identity_forget(libusb_device *device)
+{
+	t_gnusb_identity	where, *known;
+
+	identity_location(device, &where);
+	pthread_mutex_lock(&identities_lock);
+	known = identity_find(&where);
+	if (known) known->used = 0;
+	pthread_mutex_unlock(&identities_lock);
+}
+
+//--------------------------------------------------------------------------
+// blocking string descriptor queries, only for devices we haven't seen yet
+
+static int identity_query(libusb_device_handle *handle, struct libusb_device_descriptor *desc, t_gnusb_identity *id)
+{
+	if (libusb_get_string_descriptor_ascii(handle, desc->iManufacturer, (unsigned char *)id->vendor, sizeof(id->vendor)) < 0
+		|| libusb_get_string_descriptor_ascii(handle, desc->iProduct, (unsigned char *)id->product, sizeof(id->product)) < 0)
+		return 0;
+	id->serial[0] = 0;
+	if (desc->iSerialNumber
+		&& libusb_get_string_descriptor_ascii(handle, desc->iSerialNumber, (unsigned char *)id->serial, sizeof(id->serial)) < 0)
+		id->serial[0] = 0;
+	return 1;
+}
+
+
+//--------------------------------------------------------------------------
+// is this the unit the owner asked for? counts down index over the matching ones
+
+static int identity_wanted(t_gnusb_identity *id, const char *product, const char *serial, int *index)
+{
+	if (strcmp(id->vendor, GNUSB_VENDOR_NAME) != 0 || strcmp(id->product, product) != 0) return 0;
+	if (serial && *serial) return (strcmp(id->serial, serial) == 0);
+	return ((*index)-- == 0);
+}
+
+
+// ==============================================================================
+// Hotplug
+// ------------------------------------------------------------------------------
+// libusb calls this from gnusb_transport_wait() as well. no i/o allowed in here,
+// so we only take notes and let the owner open the device on its next round
+
+static int hotplug_callback(libusb_context *ctx, libusb_device *device, libusb_hotplug_event event, void *user_data)
+{
+	t_gnusb_transport	*t = (t_gnusb_transport *)user_data;
+
+	if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED) {
+		t->arrived = 1;
+	} else if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT) {
+		identity_forget(device);						// whatever comes next at this place, ask again
+		if (t->handle && libusb_get_device(t->handle) == device) t->lost = 1;
+	}
+	return 0;											// stay registered
+}
+
+
+// ==============================================================================
+// Event loop
+// ------------------------------------------------------------------------------
+
+int gnusb_transport_wait(t_gnusb_transport *t, int wake_fd, int timeout_ms)
+{
+	const struct libusb_pollfd	**usb_fds;
+	struct pollfd				fds[GNUSB_MAX_POLLFDS];
+	struct timeval				tv;
+	int							n, i, usb_ms;
+	int							woken = 0;
+
+	n = 0;
+	fds[n].fd = wake_fd;
+	fds[n].events = POLLIN;
+	n++;
+
+	// libusb may open and close descriptors at any time, so ask every round
+	usb_fds = libusb_get_pollfds(t->ctx);
+	if (usb_fds) {
+		for (i = 0; usb_fds[i] && n < GNUSB_MAX_POLLFDS; i++, n++) {
+			fds[n].fd = usb_fds[i]->fd;
+			fds[n].events = usb_fds[i]->events;
+		}
+		libusb_free_pollfds(usb_fds);
+	}
+
+	// wake up in time for libusb's own transfer timeouts
+	if (libusb_get_next_timeout(t->ctx, &tv) == 1) {
+		usb_ms = tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000;
+		if (timeout_ms < 0 || usb_ms < timeout_ms) timeout_ms = usb_ms;
+	}
+
+	if (poll(fds, n, timeout_ms) > 0 && (fds[0].revents & POLLIN)) woken = 1;
+
+	tv.tv_sec = 0;
+	tv.tv_usec = 0;
+	libusb_handle_events_timeout(t->ctx, &tv);		// completions and timeouts, never blocks
+
+	return woken;
+}
+
+
+// ==============================================================================
+// Devices
+// ------------------------------------------------------------------------------
+
+int gnusb_transport_init(t_gnusb_transport *t, t_gnusb_done done, void *owner)
+{
+	t->handle = NULL;
+	t->claimed = 0;
+	t->lost = 0;
+	t->closing = 0;
+	t->in_flight = 0;
+	t->transfers = NULL;
+	t->done = done;
+	t->owner = owner;
+	t->hotplug = 0;
+	t->serial[0] = 0;
+	t->arrived = 0;
+	t->rescan = 1;										// nothing known yet: the first scan is free
+	if (libusb_init(&t->ctx) != 0) return 0;
+
+	// without hotplug (eg. older libusb on windows) the owner keeps rescanning
+	if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)
+		&& libusb_hotplug_register_callback(t->ctx,
+				LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT, 0,
+				GNUSB_VENDOR_ID, GNUSB_PRODUCT_ID, LIBUSB_HOTPLUG_MATCH_ANY,
+				hotplug_callback, t, &t->hotplug_handle) == LIBUSB_SUCCESS)
+		t->hotplug = 1;
+	return 1;
+}
+
+//--------------------------------------------------------------------------
+
+void gnusb_transport_exit(t_gnusb_transport *t)
+{
+	gnusb_transport_close(t);
+	if (t->hotplug) libusb_hotplug_deregister_callback(t->ctx, t->hotplug_handle);
+	libusb_exit(t->ctx);
+}
+
+//--------------------------------------------------------------------------
+
+int gnusb_transport_open(t_gnusb_transport *t, const char *product, const char *serial, int index, int claim)
+{
+	libusb_device					**list;
+	libusb_device_handle			*handle = NULL;
+	struct libusb_device_descriptor	desc;
+	t_gnusb_identity				id;
+	ssize_t							count, i;
+	int								unreadable = 0;
+
+	if (t->handle) return 1;
+	if (t->hotplug && !t->arrived && !t->rescan) return 0;	// nothing new on the bus since the last scan
+	t->arrived = 0;
+	t->rescan = 0;
+
+	count = libusb_get_device_list(t->ctx, &list);
+	for (i = 0; i < count; i++) {
+		if (libusb_get_device_descriptor(list[i], &desc) < 0) continue;
+		if (desc.idVendor != GNUSB_VENDOR_ID || desc.idProduct != GNUSB_PRODUCT_ID) continue;
+
+		if (identity_lookup(list[i], &id)) {			// seen it before: no need to ask
+			if (!identity_wanted(&id, product, serial, &index)) continue;
+			if (libusb_open(list[i], &handle) == 0) break;
+			unreadable = 1;
+			continue;
+		}
+
+		if (libusb_open(list[i], &handle) < 0) {			// we need to open the device in order to query strings
+			unreadable = 1;
+			continue;
+		}
+
+		// now find out whether the device actually is ours
+		if (!identity_query(handle, &desc, &id)) {
+			unreadable = 1;
+		} else {
+			identity_store(&id);
+			if (identity_wanted(&id, product, serial, &index)) break;
+		}
+
+		libusb_close(handle);
+		handle = NULL;
+	}
+	if (count >= 0) libusb_free_device_list(list, 1);
+
+	if (!handle) {
+		t->rescan = unreadable;							// maybe just not done enumerating, try again later
+		return 0;
+	}
+
+	t->handle = handle;
+	t->lost = 0;
+	strcpy(t->serial, id.serial);
+	// older firmware has no interrupt endpoint; then claiming just doesn't matter
+	t->claimed = claim && (libusb_claim_interface(handle, 0) == 0);
+	return 1;
+}
+
+//--------------------------------------------------------------------------
+
+void gnusb_transport_close(t_gnusb_transport *t)
+{
+	t_gnusb_transfer	*tr;
+	struct timeval		tv;
+
+	if (!t->handle) return;
+
+	t->closing = 1;
+	for (tr = t->transfers; tr; tr = tr->next)
+		libusb_cancel_transfer(tr->xfer);
+	while (t->in_flight) {								// cancelled transfers still call back
+		tv.tv_sec = 0;
+		tv.tv_usec = 100000;
+		libusb_handle_events_timeout(t->ctx, &tv);
+	}
+
+	if (t->claimed) libusb_release_interface(t->handle, 0);
+	libusb_close(t->handle);
+	t->handle = NULL;
+	t->claimed = 0;
+	if (!t->lost) t->rescan = 1;						// still plugged in, so it can be opened again
+	t->lost = 0;
+	t->closing = 0;
+}
@@ -0,0 +1,95 @@
+// ==============================================================================
+// gnusb_transport.h
+//
+// Asynchronous usb transport for the host externals, built on libusb-1.0.
+// Transfers are submitted without blocking and complete from inside
+// gnusb_transport_wait(), which is the event loop of the owner's usb thread:
+// it sleeps on the libusb file descriptors and on one extra wake-up fd.
+//
+// License:
+// The project is built with AVR USB driver by Objective Development, which is
+// published under an own licence based on the GNU General Public License (GPL).
+// gnusb is also distributed under this enhanced licence. See Documentation.
+//
+// ==============================================================================
+
+#ifndef __gnusb_transport_h_included__
+#define __gnusb_transport_h_included__
+
+#include <libusb.h>			// this is libusb-1.0, see http://libusb.info
+
+#define GNUSB_VENDOR_ID			0x16C0  /* VOTI */
+#define GNUSB_PRODUCT_ID		0x05DC  /* Obdev's free shared PID */
+#define GNUSB_VENDOR_NAME		"www.anyma.ch"
+
+#define GNUSB_MAX_POLLFDS		16
+#define GNUSB_MAX_IDENTITIES	16		// devices whose strings we remember, per process
+#define GNUSB_MAX_PORTS			7		// usb allows 7 levels of hubs
+#define GNUSB_MAX_SERIAL		64
+#define GNUSB_REQ_INTERRUPT		-1		// request code reported for interrupt-in transfers
+#define GNUSB_REQ_TAG			0x100	// or'ed into a request: only tells it apart in the callback
+
+// called on the usb thread for every transfer that wasn't cancelled
+// status is a libusb_transfer_status, data/len what has come back
+typedef void (*t_gnusb_done)(void *owner, int request, int status, unsigned char *data, int len);
+
+typedef struct _gnusb_transfer t_gnusb_transfer;
+
+typedef struct _gnusb_transport
+{
+	libusb_context			*ctx;
+	libusb_device_handle	*handle;		// NULL while there is no device
+	int						claimed;		// interface 0 is ours -> interrupt endpoint usable
+	int						lost;			// device went away, owner should close
+	int						closing;		// no new transfers while we wait for cancellations
+	int						in_flight;		// transfers submitted but not completed
+	t_gnusb_transfer		*transfers;		// the transfers in flight
+	int						hotplug;		// libusb tells us about arrivals, no need to rescan blindly
+	int						arrived;		// a candidate device showed up since the last scan
+	int						rescan;			// a scan could still find something, eg. a device we closed
+	libusb_hotplug_callback_handle hotplug_handle;
+	char					serial[GNUSB_MAX_SERIAL];	// of the open device, may be empty
+	t_gnusb_done			done;
+	void					*owner;
+} t_gnusb_transport;
+
+
+// ------------------------------------------------------------------------------
+// - setup and teardown: returns 0 if libusb could not be initialized
+// ------------------------------------------------------------------------------
+extern int		gnusb_transport_init		(t_gnusb_transport *t, t_gnusb_done done, void *owner);
+extern void		gnusb_transport_exit		(t_gnusb_transport *t);
+
+// ------------------------------------------------------------------------------
+// - look for a device by product name and open it, claim interface 0 if asked
+// with a serial number only that unit will do, else the index-th one we find.
+// returns 1 if the device was found. blocks while reading string descriptors.
+// with hotplug support this returns 0 right away unless something has arrived
+// ------------------------------------------------------------------------------
+extern int		gnusb_transport_open		(t_gnusb_transport *t, const char *product, const char *serial,
+												int index, int claim);
+
+// ------------------------------------------------------------------------------
+// - cancel everything in flight and close the device
+// ------------------------------------------------------------------------------
+extern void		gnusb_transport_close		(t_gnusb_transport *t);
+
+// ------------------------------------------------------------------------------
+// - submit a vendor request / interrupt read. returns 0 or a libusb error
+// ------------------------------------------------------------------------------
+extern int		gnusb_transport_control		(t_gnusb_transport *t, int request, int value, int index,
+												unsigned char *data, int len, int in, unsigned int timeout);
+extern int		gnusb_transport_interrupt	(t_gnusb_transport *t, int endpoint, int len, unsigned int timeout);
+
+// ------------------------------------------------------------------------------
+// - cancel the transfers in flight for a request, returns how many
+// ------------------------------------------------------------------------------
+extern int		gnusb_transport_cancel		(t_gnusb_transport *t, int request);
+
+// ------------------------------------------------------------------------------
+// - event loop: wait up to timeout_ms (-1 = forever) for usb events or wake_fd
+// handles completed transfers, returns 1 if wake_fd is readable
+// ------------------------------------------------------------------------------
+extern int		gnusb_transport_wait		(t_gnusb_transport *t, int wake_fd, int timeout_ms);
+
+#endif /* __gnusb_transport_h_included__ */
@@ -101,10 +101,10 @@ ISR(INT1_vect) {}
 // - Write to EEPROM
 // ------------------------------------------------------------------------------
 // from PowerSwitch by Objective Development
- void eepromWrite(unsigned char addr, unsigned char val)
+ void eepromWrite(unsigned short addr, unsigned char val)
 {
     while(EECR & (1 << EEWE));
-    EEARL = addr;
+    EEAR = addr;
     EEDR = val;
     cli();
     EECR |= 1 << EEMWE;
@@ -113,14 +113,23 @@ ISR(INT1_vect) {}
 }
 
 
+// ------------------------------------------------------------------------------
+// - EEPROM ready
+// ------------------------------------------------------------------------------
+// -> 1 if a write would start right away, 0 while the last one is still busy
+uchar eepromReady(void)
+{
+    return !(EECR & (1 << EEWE));
+}
+
 // ------------------------------------------------------------------------------
 // - Read EEPROM
 // ------------------------------------------------------------------------------
 // from PowerSwitch by Objective Development
-uchar eepromRead(uchar addr)
+uchar eepromRead(unsigned short addr)
 {
     while(EECR & (1 << EEWE));
-    EEARL = addr;
+    EEAR = addr;
     EECR |= 1 << EERE;
     return EEDR;
 }
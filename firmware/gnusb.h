@@ -18,12 +18,16 @@
 // ==============================================================================
 // includes
 // ------------------------------------------------------------------------------
+#ifndef GNUSB_NATIVE
 // AVR Libc (see http://www.nongnu.org/avr-libc/)
 #include <avr/io.h>				// include I/O definitions (port names, pin names, etc)
 #include <avr/interrupt.h>		// include interrupt support
 #include <avr/pgmspace.h>
 #include <avr/wdt.h>			// include watchdog timer support
 #include <avr/sleep.h>			// include cpu sleep support
+#else
+#include "native/native.h"		// built for the host, on mocked hardware
+#endif
 
 // USB driver by Objective Development (see http://www.obdev.at/products/avrusb/index.html)
 #include "usbdrv.h"
@@ -53,12 +57,17 @@
 // ------------------------------------------------------------------------------
 // - Write to EEPROM
 // ------------------------------------------------------------------------------
-extern  void eepromWrite(unsigned char addr, unsigned char val);
+extern  void eepromWrite(unsigned short addr, unsigned char val);
+
+// ------------------------------------------------------------------------------
+// - EEPROM ready
+// ------------------------------------------------------------------------------
+extern uchar eepromReady(void);
 
 // ------------------------------------------------------------------------------
 // - Read EEPROM
 // ------------------------------------------------------------------------------
-extern uchar eepromRead(uchar addr);
+extern uchar eepromRead(unsigned short addr);
 
 // ------------------------------------------------------------------------------
 // - Status Leds
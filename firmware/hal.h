@@ -0,0 +1,141 @@
+// ==============================================================================
+// hal.h
+// hardware access of the gnusbmatrix firmware
+//
+// Everything main.c does with the switch matrix, the leds and timer 0 goes
+// through here, so the scan, mode and preset code doesn't care what it runs
+// on. Normally that's the ATmega16. Built with -DGNUSB_NATIVE, the same calls
+// work on mocked registers in native/hal_native.c instead, and the firmware
+// compiles for the build host (see the native target in the Makefile).
+//
+// License:
+// The project is built with AVR USB driver by Objective Development, which is
+// published under an own licence based on the GNU General Public License (GPL).
+// gnusb is also distributed under this enhanced licence. See Documentation.
+//
+// target-cpu: ATMega16 @ 12MHz
+//
+// ==============================================================================
+
+#ifndef __hal_h_included__
+#define __hal_h_included__
+
+// include after gnusb.h
+
+#ifndef GNUSB_NATIVE
+
+// ==============================================================================
+// ATmega16
+// ------------------------------------------------------------------------------
+
+#define LED_PORT 	PORTC
+#define SWITCH_PORT PORTB
+#define	MUX_PORT	PORTA
+
+// ------------------------------------------------------------------------------
+// - halInitPorts
+// ------------------------------------------------------------------------------
+// mux and leds are outputs, switches inputs with pullups. starts timer 0,
+// its overflow interrupt scans the matrix (see main.c)
+
+static inline void halInitPorts(void)
+{
+	// PORTA: MUX
+	DDRA 	= 0xff;		// set all pins to output
+	PORTA 	= 0x01;		// row 0, the first scan reads it
+
+	// PORTB: Switches
+	DDRB 	= 0x00;		// set all pins to input
+	PORTB 	= 0xff;		// make sure pull-up resistors are turned ON
+
+	// PORTC: LEDS
+	DDRC 	= 0xff;		// set all pins to output
+	PORTC 	= 0x00;		// turn off
+
+	TCCR0 = (1 << CS01); 	// start timer 0 fck/8
+	TCCR0 |= (1 << CS00); 	// start timer 0 fck/64
+	TIMSK |= (1 << TOIE0);	// overflow interrupt, ca. every 1.4ms
+}
+
+// ------------------------------------------------------------------------------
+// - halShowRow
+// ------------------------------------------------------------------------------
+// switch the multiplexer to a row and light its leds
+
+static inline void halShowRow(u08 row, u08 leds)
+{
+	LED_PORT = 0;
+	MUX_PORT = (1 << row);
+	LED_PORT = leds;
+}
+
+// ------------------------------------------------------------------------------
+// - halReadSwitches
+// ------------------------------------------------------------------------------
+// switches of the row halShowRow() selected, 1 = pressed. the lines need a
+// while to settle after a row change: read before selecting the next row,
+// not right after
+
+static inline u08 halReadSwitches(void)
+{
+	return ~PINB;						// pullups : 1 = not pressed
+}
+
+// ------------------------------------------------------------------------------
+// - halSuspend / halResume
+// ------------------------------------------------------------------------------
+// everything dark while the host sleeps
+
+static inline void halSuspend(void)
+{
+	TCCR0 = 0; 	// stop timer 0 fck/8
+	PORTA = 0;
+	PORTB = 0;
+	PORTC = 0;
+}
+
+static inline void halResume(void)
+{
+	TCCR0 = (1 << CS01); 	// start timer 0 fck/8
+	TCCR0 |= (1 << CS00); 	// start timer 0 fck/64
+	PORTB 	= 0xff;		// make sure pull-up resistors are turned ON
+}
+
+#else
+
+// ==============================================================================
+// Build host, see native/native.h for the mocked registers
+// ------------------------------------------------------------------------------
+
+static inline void halInitPorts(void)
+{
+	hal_row = 0;
+	hal_leds = 0;
+	hal_timer_running = 1;
+}
+
+static inline void halShowRow(u08 row, u08 leds)
+{
+	hal_row = row;
+	hal_leds = leds;
+}
+
+static inline u08 halReadSwitches(void)
+{
+	return hal_switches[hal_row];
+}
+
+static inline void halSuspend(void)
+{
+	hal_timer_running = 0;
+	hal_leds = 0;
+}
+
+static inline void halResume(void)
+{
+	hal_timer_running = 1;
+}
+
+#endif /* GNUSB_NATIVE */
+
+#endif /* __hal_h_included__ */
@@ -13,60 +13,735 @@
 // ==============================================================================
 
 #include "gnusb.h"				// the gnusb library: setup and utility functions 
-#include <util/delay.h>
+#include "hal.h"				// switch matrix, leds and timer
 // ==============================================================================
 // Constants
 // ------------------------------------------------------------------------------
 #define LED_KEEP_ALIVE	100  	// number of passes before usb status led turns off
 
-#define LED_PORT 	PORTC
-#define SWITCH_PORT PORTB
-#define	MUX_PORT	PORTA
-
 #define WRITE_MODES 	0x02
 #define WRITE_VALUES 	0x03
+#define WRITE_SERIAL 	0x04
+#define WRITE_REFUSED	0x05		// no room in the eeprom queue: stall the data
+
+#define WAIT_CHANGES	0x01		// GNUSB_CMD_WAIT_CHANGES is NAKing its answer
+#define WAIT_REPLY		0x02		// and now hands it to usbFunctionRead()
+
+#define SERIAL_ADDRESS	(E2END + 1 - GNUSB_SERIAL_LEN)	// serial number lives in the last eeprom bytes
+#define DEBOUNCE_ADDRESS	(SERIAL_ADDRESS - 1)		// debounce window, right below it
+#define PRESET_FORMAT_ADDRESS	(DEBOUNCE_ADDRESS - 1)	// PRESET_PACKED once the presets are
+#define PRESET_ADDRESS	64								// after the mode table
+#define PRESET_SPACE	(PRESET_FORMAT_ADDRESS - PRESET_ADDRESS)	// for the packed presets: 438 bytes
+#define PRESET_PACKED	0x01
+#define PRESETS_UNPACKED	(PRESET_SPACE / 8)			// raw 8 byte presets of older firmware: 54
+#define PRESETS			128
+#define PRESETS_IN_RAM	16								// the first ones, see recallPreset()
+#define PRESET_NONE		0xff							// in preset_at[]: no record, all rows off
+#define PRESET_SLACK	64								// free bytes left when compacting starts
+#define PRESET_RESERVE	16								// kept free for the compaction, see presets
+#define PRESET_SKIP		0x80							// in the log: a gap instead of a record
+#define PRESET_SKIP_MAX	252								// its longest
 
-#define BTN_DEBOUNCE_TOGGLE	100		// number of passes before a button can trigger again
+#define DEBOUNCE_DEFAULT	2		// scans of a row a change has to last, ca. 11ms each
+
+#define SCAN_EVENTS		8			// changed rows the scan can queue up, power of 2
+#define BUTTON_EVENTS	GNUSB_EVENTS_MAX	// presses and releases kept for the host, power of 2
+#define RADIO_GROUPS	8			// radio groups with a precomputed member mask
+#define EEPROM_JOBS		8			// eeprom writes that can wait, power of 2
+#define PRESET_JOBS		3			// what a store queues: end of the log, record, number
 
 // ==============================================================================
 // Globals
 // ------------------------------------------------------------------------------
 
 static u08		mux;
-static u08		switch_states[8],switch_states_before[8],switch_debounce[64];
+static u08		switch_states[8];							// as far as checkButtons() got
+
+// the scan interrupt hands changed rows to the main loop through this queue
+static volatile unsigned short	scan_ticks;						// timer 0 overflows, wraps: the device clock
+static u08		scan_states[8];								// switches as the scan read them, debounced
+static u08		debounce_count[3][8];						// per row: bit n of the counts of its 8 buttons
+static u08		debounce_window[3] = {						// bit n of the window, 0x00 or 0xff
+					(DEBOUNCE_DEFAULT & 1) ? 0xff : 0, (DEBOUNCE_DEFAULT & 2) ? 0xff : 0, (DEBOUNCE_DEFAULT & 4) ? 0xff : 0 };
+static u08		event_row[SCAN_EVENTS],event_state[SCAN_EVENTS];
+static unsigned short	event_time[SCAN_EVENTS];			// scan_ticks when the row was read
+static volatile u08	event_head;								// written by the scan only
+static volatile u08	event_tail;								// written by checkButtons() only
 
 static u08 		button_modes[64];
+static u08		toggle_mask[8],impulse_mask[8],radio_row_mask[8];	// buttons per row and mode, in led_values bit order
+static u08		radio_group[RADIO_GROUPS];					// mode byte of the group, 0 = free
+static u08		radio_mask[RADIO_GROUPS][8];				// its buttons, in led_values bit order
+static u08		masks_stale;								// the modes changed since buildModeMasks()
 static u08		led_values[8];								// state of all 
+static u08		button_events[BUTTON_EVENTS];				// for GNUSB_CMD_READ_EVENTS, see pushEvents()
+static unsigned short	button_times[BUTTON_EVENTS];
+static u08		button_head,button_tail;
+static u08		button_lost;								// GNUSB_EVENTS_LOST if the host missed some
+static u08		button_reply[3 + 3 * BUTTON_EVENTS];		// status byte, clock and events, oldest first
+static u08		presets[PRESETS_IN_RAM][8];					// copy of the first presets in eeprom
+static u08		preset_at[PRESETS];							// their records in the log, in 2 byte steps
+static unsigned short	preset_end,preset_live;				// log bytes in use, by live records
+static unsigned short	compact_from,compact_to;			// next record to compact, where it goes
+static u08		compacting;
+static u08		store_pending,store_preset,store_rows[8];	// a store that waits for the jobs or the compaction
+static unsigned short	store_live;							// preset_live once it's done
+static u08		preset_info[3];								// for GNUSB_CMD_GET_PRESETS and STORE_PRESET
+static u08		debounce_saved;								// for GNUSB_CMD_SET_DEBOUNCE
 static u08 		write_state,write_idx,write_len;
+static u08		report_pending;								// led_values changed since last interrupt report
+static u08		last_report[8];								// what the host got last time
+static unsigned short	generation;							// counts changes of led_values, see pollChanges()
+static unsigned short	row_generation[8];					// when each row changed last
+static u08		generation_values[8];						// led_values as of generation
+static u08		changes_reply[3 + 8];						// for GNUSB_CMD_POLL_CHANGES
+static u08		wait_state,wait_flags,wait_len,wait_sent;	// GNUSB_CMD_WAIT_CHANGES
+static unsigned short	wait_since,wait_until;
+static int		serial_descriptor[1 + GNUSB_SERIAL_LEN];	// usb string descriptor: header + 16bit chars
+
+typedef struct _eeprom_job
+{
+	unsigned short	addr;
+	u08				len;
+	u08				data[9];									// a packed preset at most
+} t_eeprom_job;
+
+static t_eeprom_job	eeprom_jobs[EEPROM_JOBS];
+static u08		eeprom_head,eeprom_tail;					// queue of jobs, tail is the oldest
+static u08		eeprom_done;								// bytes of the oldest job done so far
+
+static u08		modes_dirty[8];								// mode bytes that differ from the eeprom, 1 bit each
+static u08		modes_autocommit = 1;						// save mode changes right away
+static u08		modes_committing;							// saving the dirty modes
 
 
+// ------------------------------------------------------------------------------
+// - eeprom jobs
+// ------------------------------------------------------------------------------
+// an eeprom write takes 8.5ms and the usb requests can't wait for that: they
+// queue the write as a job of up to 9 bytes instead, and the main loop writes
+// one byte whenever the eeprom is ready. bytes the eeprom already holds are
+// skipped, they'd only cost time and wear. a request never waits for room
+// either: the setters check eepromRoom() first and fail without it, a preset
+// store waits in ram. the main loop queues only once the jobs are done
+// the mode table doesn't go through jobs: changed modes are marked dirty, and
+// get saved once they're committed (right away, with autocommit)
+
+static void eepromWriteNext(void) {
+	t_eeprom_job *job = &eeprom_jobs[eeprom_tail % EEPROM_JOBS];
+	unsigned short addr;
+	u08 val;
+	
+	while (eeprom_done < job->len) {
+		addr = job->addr + eeprom_done;
+		val = job->data[eeprom_done++];
+		if (eepromRead(addr) != val) {
+			eepromWrite(addr, val);
+			break;
+		}
+	}
+	if (eeprom_done < job->len) return;
+	eeprom_done = 0;
+	eeprom_tail++;
+}
+
+// -> 0 once no mode is dirty anymore
+static u08 saveNextMode(void) {
+	u08 row,col,i;
+	
+	for (row = 0; row < 8; row++) {
+		while (modes_dirty[row]) {
+			for (col = 0; !(modes_dirty[row] & (1 << col)); col++);
+			modes_dirty[row] &= ~(1 << col);
+			i = 8 * row + col;
+			if (eepromRead(i) != button_modes[i]) {
+				eepromWrite(i, button_modes[i]);
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+static u08 compactNext(void);		// see presets
+static void storeWaiting(void);
+
+void eepromPoll(void) {
+	if (!eepromReady()) return;
+	if (eeprom_head != eeprom_tail) eepromWriteNext();
+	else if (modes_committing) modes_committing = saveNextMode();		// setMode() starts it again
+	else if (compacting) compacting = compactNext();
+	else if (store_pending) storeWaiting();
+}
+
+// -> jobs that can still be queued
+u08 eepromRoom(void) {
+	return EEPROM_JOBS - (u08)(eeprom_head - eeprom_tail);
+}
+
+// -> 0 if the queue is full, nothing gets written then
+u08 eepromQueue(unsigned short addr, u08 *data, u08 len) {
+	t_eeprom_job *job;
+	u08 i;
+	
+	if (!eepromRoom()) return 0;
+	job = &eeprom_jobs[eeprom_head % EEPROM_JOBS];
+	job->addr = addr;
+	job->len = len;
+	for (i = 0; i < len; i++) {
+		job->data[i] = data[i];
+	}
+	eeprom_head++;
+	return 1;
+}
+
+// -> the byte the newest job has for that address, 0 if there is none
+u08 *eepromQueued(unsigned short addr) {
+	t_eeprom_job *job;
+	u08 i,*data;
+	
+	data = 0;
+	for (i = eeprom_tail; i != eeprom_head; i++) {
+		job = &eeprom_jobs[i % EEPROM_JOBS];
+		if ((unsigned short)(addr - job->addr) < job->len) data = &job->data[addr - job->addr];
+	}
+	return data;
+}
+
+void setMode(u08 btn, u08 mode) {
+	if (button_modes[btn] == mode) return;
+	button_modes[btn] = mode;
+	modes_dirty[btn / 8] |= (1 << (btn % 8));
+	if (modes_autocommit) modes_committing = 1;
+	masks_stale = 1;											// checkButtons() rebuilds them
+}
+
 // ------------------------------------------------------------------------------
 // - read and write presets
 // ------------------------------------------------------------------------------
-// first 64 byytes in eeprom are reserved for button mode table
-// preset 0 gets loaded on startup
+// first 64 byytes in eeprom are reserved for button mode table, the presets
+// take the rest up to the settings at the end. preset 0 gets loaded on startup
+// most presets light a few rows only, so they're packed into a log of records:
+//   preset number, bitmap of its non-zero rows (row 0 = bit 0), those rows
+// padded to an even length. a store appends a record and the old one is dead.
+// a number with PRESET_SKIP set is no record but a gap: it skips twice the
+// rest in bytes. on startup, the log gets read into preset_at[]: later records
+// win, 0xff (erased) ends it. presets without a record are all off.
+// once the log gets full, the main loop compacts it in the background, one
+// entry at a time: the dead ones widen the gap, the live ones move down into
+// it and the gap moves on behind them. each step rewrites the single byte that
+// makes it count last, so a reset at any point leaves a log that reads the
+// same. a record longer than the gap goes to the end instead, into the
+// PRESET_RESERVE stores leave free, and is dead where it was.
+// a store that doesn't fit before the compaction is done waits for it, and so
+// does one that finds the job queue without room for PRESET_JOBS
+// the first PRESETS_IN_RAM presets are kept in ram as well, so their recall is
+// a copy of 8 bytes and never waits for the eeprom. the others are read from
+// their record, through the jobs that haven't made it to the eeprom yet
+
+// -> bytes of a record with these rows
+static u08 presetSize(u08 bits) {
+	u08 size;
+	
+	for (size = 2; bits; bits &= bits - 1) size++;
+	return (size + 1) & ~1;
+}
+
+// -> bytes of the log entry there, 0 where the log ends. straight from the
+// eeprom: only for when no job is waiting
+static u08 entrySize(unsigned short at) {
+	u08 number;
+	
+	number = eepromRead(PRESET_ADDRESS + at);
+	if (number == 0xff) return 0;
+	if (number & PRESET_SKIP) return 2 * (number & ~PRESET_SKIP);
+	return presetSize(eepromRead(PRESET_ADDRESS + at + 1));
+}
+
+// -> bytes of the record without its number: bitmap and non-zero rows
+static u08 packRows(u08 *rows, u08 *record) {
+	u08 i,n;
+	
+	record[0] = 0;
+	n = 1;
+	for (i = 0; i < 8; i++) {
+		if (!rows[i]) continue;
+		record[0] |= (1 << i);
+		record[n++] = rows[i];
+	}
+	return n;
+}
 
+static u08 presetRead(unsigned short at) {
+	u08 *queued;
+	
+	queued = eepromQueued(PRESET_ADDRESS + at);
+	return queued ? *queued : eepromRead(PRESET_ADDRESS + at);
+}
+
+static void readPreset(u08 preset, u08 *rows) {
+	unsigned short at;
+	u08 i,bits;
+	
+	bits = 0;
+	at = 2 * preset_at[preset] + 1;
+	if (preset_at[preset] != PRESET_NONE) bits = presetRead(at);
+	for (i = 0; i < 8; i++) {
+		rows[i] = (bits & (1 << i)) ? presetRead(++at) : 0;
+	}
+}
+
+// the number goes last: until it's written, the log ends where it did
+static void writeRecord(unsigned short at, u08 preset, u08 *record, u08 n) {
+	eepromQueue(PRESET_ADDRESS + at + 1, record, n);
+	eepromQueue(PRESET_ADDRESS + at, &preset, 1);
+}
+
+// a record after the last one, and a new end behind it
+static void appendRecord(u08 preset, u08 *record, u08 n) {
+	u08 size,end;
+	
+	size = presetSize(record[0]);
+	end = 0xff;
+	if (preset_end + size < PRESET_SPACE) eepromQueue(PRESET_ADDRESS + preset_end + size, &end, 1);
+	writeRecord(preset_end, preset, record, n);
+	preset_at[preset] = preset_end / 2;						// an empty one too, or the
+	preset_end += size;										// old one comes back
+}
+
+// a gap from one offset to the other, at most PRESET_SKIP_MAX bytes
+static void writeSkip(unsigned short at, unsigned short to) {
+	u08 skip;
+	
+	skip = PRESET_SKIP | ((to - at) / 2);
+	eepromQueue(PRESET_ADDRESS + at, &skip, 1);
+}
+
+static void startCompacting(void) {
+	compact_from = 0;
+	compact_to = 0;
+	compacting = 1;
+}
 
-void storePreset(u08 preset) {
+// one entry further, -> 0 once the log is compacted. the gap goes from
+// compact_to to compact_from, a skip at compact_to says so
+static u08 compactNext(void) {
+	u08 preset,size,n,bits,end;
+	u08 record[9];
+	
+	if (compact_from >= preset_end) {
+		if (compact_to < compact_from) {					// the gap is the new end
+			end = 0xff;
+			eepromQueue(PRESET_ADDRESS + compact_to, &end, 1);
+			preset_end = compact_to;
+		}
+		return 0;
+	}
+	preset = eepromRead(PRESET_ADDRESS + compact_from);
+	size = entrySize(compact_from);
+	if (preset >= PRESETS || preset_at[preset] != compact_from / 2) {		// dead or a gap
+		if (compact_from + size - compact_to > PRESET_SKIP_MAX) compact_to = compact_from;	// a new gap
+		compact_from += size;
+		writeSkip(compact_to, compact_from);
+		return 1;
+	}
+	if (compact_to == compact_from) {						// nothing to move down
+		compact_to += size;
+		compact_from += size;
+		return 1;
+	}
+	
+	record[0] = eepromRead(PRESET_ADDRESS + compact_from + 1);
+	for (n = 1, bits = record[0]; bits; bits &= bits - 1, n++) {
+		record[n] = eepromRead(PRESET_ADDRESS + compact_from + 1 + n);
+	}
+	if (compact_from - compact_to < size) {					// it would overwrite itself
+		if (preset_end + size <= PRESET_SPACE) {
+			appendRecord(preset, record, n);				// next time round it's dead here
+		} else {
+			compact_from += size;							// leave the gap as it is
+			compact_to = compact_from;
+		}
+		return 1;
+	}
+	
+	// the copy goes into the gap, the rest of the gap behind it, and the
+	// number makes it count. with the gap just as long as the record, the
+	// old record is the rest of the gap: a duplicate until the skip is written
+	eepromQueue(PRESET_ADDRESS + compact_to + 1, record, n);
+	if (compact_to + size < compact_from) {
+		writeSkip(compact_to + size, compact_from + size);
+		eepromQueue(PRESET_ADDRESS + compact_to, &preset, 1);
+	} else {
+		eepromQueue(PRESET_ADDRESS + compact_to, &preset, 1);
+		writeSkip(compact_from, compact_from + size);
+	}
+	preset_at[preset] = compact_to / 2;
+	compact_to += size;
+	compact_from += size;
+	return 1;
+}
+
+static void eepromUpdate(unsigned short addr, u08 val) {
+	wdt_reset();
+	if (eepromRead(addr) != val) eepromWrite(addr, val);
+}
+
+// older firmware kept raw presets at PRESET_ADDRESS + 8 * preset. they get
+// packed in place on the first start, before usb is up. a packed one can take
+// 10 bytes, so the raw ones are read ahead into presets[] before the log gets
+// to them. erased ones (all 0xff) were never stored and stay off
+static void packPresets(void) {
+	unsigned short at;
+	u08 preset,ahead,i,n,size,*raw;
+	u08 record[9];
+	
+	at = 0;
+	ahead = 0;
+	for (preset = 0; preset < PRESETS_UNPACKED; preset++) {
+		for (; ahead < PRESETS_UNPACKED && (ahead <= preset || 8 * ahead < at + 10); ahead++) {
+			for (i = 0; i < 8; i++) {
+				presets[ahead % PRESETS_IN_RAM][i] = eepromRead(PRESET_ADDRESS + 8 * ahead + i);
+			}
+		}
+		raw = presets[preset % PRESETS_IN_RAM];
+		for (i = 0; i < 8 && raw[i] == 0xff; i++);
+		if (i == 8) continue;
+		n = packRows(raw, record);
+		size = presetSize(record[0]);
+		if (!record[0] || at + size > PRESET_SPACE) continue;
+		eepromUpdate(PRESET_ADDRESS + at, preset);
+		for (i = 0; i < n; i++) {
+			eepromUpdate(PRESET_ADDRESS + at + 1 + i, record[i]);
+		}
+		at += size;
+	}
+	if (at < PRESET_SPACE) eepromUpdate(PRESET_ADDRESS + at, 0xff);
+	eepromUpdate(PRESET_FORMAT_ADDRESS, PRESET_PACKED);
+}
+
+void loadPresets(void) {
+	unsigned short at;
+	u08 preset,size;
+	
+	if (eepromRead(PRESET_FORMAT_ADDRESS) != PRESET_PACKED) packPresets();
+	
+	for (preset = 0; preset < PRESETS; preset++) {
+		preset_at[preset] = PRESET_NONE;
+	}
+	preset_live = 0;
+	for (at = 0; at + 2 <= PRESET_SPACE; at += size) {
+		preset = eepromRead(PRESET_ADDRESS + at);
+		size = entrySize(at);
+		if (!size || at + size > PRESET_SPACE) break;
+		if (preset >= PRESETS) continue;					// a gap
+		if (preset_at[preset] != PRESET_NONE) {
+			preset_live -= presetSize(eepromRead(PRESET_ADDRESS + 2 * preset_at[preset] + 1));
+		}
+		preset_at[preset] = at / 2;
+		preset_live += size;
+	}
+	preset_end = at;
+	
+	for (preset = 0; preset < PRESETS_IN_RAM; preset++) {
+		readPreset(preset, presets[preset]);
+	}
+}
+
+// -> 0 if it doesn't fit behind the log right now
+static u08 storeRows(u08 preset, u08 *rows) {
+	u08 n,size;
+	u08 record[9];
+	
+	n = packRows(rows, record);
+	size = presetSize(record[0]);
+	if (preset_end + size > PRESET_SPACE - PRESET_RESERVE) return 0;
+	
+	if (preset_at[preset] != PRESET_NONE) {
+		preset_live -= presetSize(presetRead(2 * preset_at[preset] + 1));
+	}
+	appendRecord(preset, record, n);
+	preset_live += size;
+	
+	if (!compacting && PRESET_SPACE - preset_end < PRESET_SLACK && preset_live < preset_end) startCompacting();
+	return 1;
+}
+
+// -> 0 if there's no room for it, not even once the log is compacted
+u08 storePreset(u08 preset) {
 	u08 i;
-	u08 address;			
-	address = 8 * preset;
-	if (address > 0xF7) return;  // todo  gnusb.h only supports 8bit adressing of eeprom
+	u08 record[9];
+	unsigned short live;
+	
+	if (preset >= PRESETS) return 0;
+	packRows(led_values, record);
+	if (!record[0] && preset_at[preset] == PRESET_NONE && !(store_pending && store_preset == preset))
+		return 1;												// off already
+	if (store_pending && store_preset != preset) return 0;		// another one waits already
+	live = preset_live + presetSize(record[0]);					// the old one goes after
+	if (live > PRESET_SPACE - PRESET_RESERVE) return 0;
+	if (preset_at[preset] != PRESET_NONE) live -= presetSize(presetRead(2 * preset_at[preset] + 1));
+	
+	for (i = 0; preset < PRESETS_IN_RAM && i < 8; i++) {
+		presets[preset][i] = led_values[i];
+	}
+	store_pending = 0;											// this one is newer
+	if (eepromRoom() >= PRESET_JOBS && storeRows(preset, led_values)) return 1;
 	
 	for (i = 0; i < 8; i++) {
-		eepromWrite(64 + address + i,led_values[i]);
-	}	
+		store_rows[i] = led_values[i];
+	}
+	store_preset = preset;
+	store_live = live;
+	store_pending = 1;
+	if (!compacting && preset_end + presetSize(record[0]) > PRESET_SPACE - PRESET_RESERVE) startCompacting();
+	return 1;
+}
+
+// the store that waited, once the jobs and the compaction are done
+static void storeWaiting(void) {
+	if (storeRows(store_preset, store_rows)) store_pending = 0;
+	else if (preset_live < preset_end) startCompacting();		// it left some gaps
+	else store_pending = 0;										// storePreset() made sure it fits
+}
+
+// -> bytes left for presets once the log is compacted, for GNUSB_CMD_GET_PRESETS
+static unsigned short presetsFree(void) {
+	return PRESET_SPACE - PRESET_RESERVE - (store_pending ? store_live : preset_live);
 }
 
 void recallPreset(u08 preset) {
+	u08 i,*rows;
+	
+	if (preset >= PRESETS) return;
+	rows = 0;
+	if (preset < PRESETS_IN_RAM) rows = presets[preset];
+	if (store_pending && preset == store_preset) rows = store_rows;
+	if (rows) {
+		for (i = 0; i < 8; i++) {
+			led_values[i] = rows[i];
+		}	
+		return;
+	}
+	readPreset(preset, led_values);
+}
+
+
+// ------------------------------------------------------------------------------
+// - serial number
+// ------------------------------------------------------------------------------
+// up to GNUSB_SERIAL_LEN printable chars from eeprom, erased bytes (0xff) end it.
+// the host only sees a new serial after the matrix has been replugged
+
+void loadSerial(void) {
+	u08 i,c;
+	
+	for (i = 0; i < GNUSB_SERIAL_LEN; i++) {
+		c = eepromRead(SERIAL_ADDRESS + i);
+		if (c < 0x20 || c > 0x7e) break;
+		serial_descriptor[1 + i] = c;
+	}
+	serial_descriptor[0] = USB_STRING_DESCRIPTOR_HEADER(i);
+}
+
+// -> 0 if it can't be saved now, see eepromRoom()
+u08 storeSerial(u08 len) {
+	u08 i,serial[GNUSB_SERIAL_LEN];
+	
+	for (i = 0; i < GNUSB_SERIAL_LEN; i++) {
+		serial[i] = (i < len) ? serial_descriptor[1 + i] : 0xff;
+	}
+	if (!eepromQueue(SERIAL_ADDRESS, serial, GNUSB_SERIAL_LEN)) return 0;
+	serial_descriptor[0] = USB_STRING_DESCRIPTOR_HEADER(len);
+	return 1;
+}
+
+// ------------------------------------------------------------------------------
+// - debounce window
+// ------------------------------------------------------------------------------
+// how many scans in a row a switch has to read differently before it counts,
+// 1 (no debouncing) to GNUSB_DEBOUNCE_MAX. anything else gets the default
+
+void setDebounce(u08 scans) {
+	u08 i;
+	
+	if (scans < 1 || scans > GNUSB_DEBOUNCE_MAX) scans = DEBOUNCE_DEFAULT;
+	for (i = 0; i < 3; i++) {
+		debounce_window[i] = (scans & (1 << i)) ? 0xff : 0;
+	}
+}
+
+// ------------------------------------------------------------------------------
+// - mode masks
+// ------------------------------------------------------------------------------
+// the mode table as bit masks, rebuilt once the modes have changed: which buttons
+// of a row toggle, follow (impulse) or are radio buttons, so checkButtons()
+// deals with a whole row at once. and the first RADIO_GROUPS groups in the
+// table get a mask of their buttons, so a press turns off the others in one
+// pass over the rows. that's two passes over the whole table, too long for a
+// usb request: setMode() only marks the masks stale, and the main loop rebuilds
+// them before it looks at the buttons again
+
+void buildModeMasks(void) {
+	u08 i,slot,bit;
+	
+	masks_stale = 0;
+	for (i = 0; i < 8; i++) {
+		toggle_mask[i] = 0;
+		impulse_mask[i] = 0;
+		radio_row_mask[i] = 0;
+	}
+	for (i = 0; i < 64; i++) {
+		bit = (1 << (7 - i % 8));
+		switch (button_modes[i] & BTN_MODE_MASK) {
+			case BTN_MODE_TOGGLE:	toggle_mask[i / 8] |= bit;		break;
+			case BTN_MODE_IMPULSE:	impulse_mask[i / 8] |= bit;		break;
+			case BTN_MODE_RADIO:	radio_row_mask[i / 8] |= bit;	break;
+		}
+	}
+	
+	for (slot = 0; slot < RADIO_GROUPS; slot++) {
+		radio_group[slot] = 0;
+		for (i = 0; i < 8; i++) {
+			radio_mask[slot][i] = 0;
+		}
+	}
+	for (i = 0; i < 64; i++) {
+		if ((button_modes[i] & BTN_MODE_MASK) != BTN_MODE_RADIO) continue;
+		for (slot = 0; slot < RADIO_GROUPS; slot++) {
+			if (!radio_group[slot]) radio_group[slot] = button_modes[i];
+			if (radio_group[slot] == button_modes[i]) break;
+		}
+		if (slot < RADIO_GROUPS) radio_mask[slot][i / 8] |= (1 << (7 - i % 8));
+	}
+}
+
+// turn off all buttons of a radio group
+void clearRadioGroup(u08 group) {
+	u08 slot,row,col;
+	
+	for (slot = 0; slot < RADIO_GROUPS; slot++) {
+		if (radio_group[slot] != group) continue;
+		for (row = 0; row < 8; row++) {
+			led_values[row] &= ~radio_mask[slot][row];
+		}
+		return;
+	}
+							// more groups than masks: look them up
+	for (row = 0; row < 8; row++) {
+		for (col = 0; col < 8; col++) {
+			if (button_modes[ 8 * row + col] == group) {					
+				led_values[row] &= ~(1 << (7 - col));
+			}	
+		}
+	}
+}
+
+// ------------------------------------------------------------------------------
+// - pollChanges
+// ------------------------------------------------------------------------------
+// the rows that changed after generation since, for GNUSB_CMD_POLL_CHANGES.
+// led_values change in many places, so the generation moves when somebody asks
+// and finds them different from last time: a row that flips back and forth
+// in between hasn't changed. a lone 0 if nothing has, else the row bitmap,
+// the generation and the rows. -> returns the length of the answer
+
+static u08 pollChanges(unsigned short since, u08 all) {
+	u08 i,n,rows;
+	
+	rows = 0;
+	for (i = 0; i < 8; i++) {
+		if (generation_values[i] != led_values[i]) rows |= (1 << i);
+	}
+	if (rows) {
+		generation++;
+		for (i = 0; i < 8; i++) {
+			if (!(rows & (1 << i))) continue;
+			row_generation[i] = generation;
+			generation_values[i] = led_values[i];
+		}
+	}
+	
+	rows = 0;
+	n = 3;
+	for (i = 0; i < 8; i++) {
+		if (!all && (unsigned short)(generation - row_generation[i]) >= (unsigned short)(generation - since)) continue;
+		rows |= (1 << i);
+		changes_reply[n++] = generation_values[i];
+	}
+	changes_reply[0] = rows;
+	if (!rows) return 1;
+	changes_reply[1] = generation & 0xff;
+	changes_reply[2] = generation >> 8;
+	return n;
+}
+
+
+// ------------------------------------------------------------------------------
+// - hostResync
+// ------------------------------------------------------------------------------
+// the host is about to get led_values, and a report still waiting on the
+// interrupt endpoint would only take it back in time
+
+static void hostResync(void) {
 	u08 i;
 	
-	u08 address;			
-	address = 8 * preset;
+	usbTxLen1 = USBPID_NAK;
+	for (i = 0; i < 8; i++) {
+		last_report[i] = led_values[i];
+	}
+}
+
+// ------------------------------------------------------------------------------
+// - usbFunctionReadWait / usbFunctionRead
+// ------------------------------------------------------------------------------
+// GNUSB_CMD_WAIT_CHANGES: the driver asks before it sends the answer, and the
+// host gets NAKs until the rows differ from its generation, button events
+// wait to be read (if it asked for those) or the timeout runs out. then the
+// answer is the one of GNUSB_CMD_POLL_CHANGES
+
+uchar usbFunctionReadWait(void) {
+	u08 i,changed;
+	unsigned short now;
+	
+	if (wait_state != WAIT_CHANGES) return 0;
 	
+	changed = (wait_flags & GNUSB_WAIT_ALL) || wait_since != generation;
 	for (i = 0; i < 8; i++) {
-		led_values[i] = eepromRead(64 + address + i);
-	}	
+		if (generation_values[i] != led_values[i]) changed = 1;
+	}
+	if ((wait_flags & GNUSB_WAIT_EVENTS) && button_head != button_tail) changed = 1;
+	cli();
+	now = scan_ticks;
+	sei();
+	if (!changed && (short)(now - wait_until) < 0) return 1;
+	
+	hostResync();
+	wait_len = pollChanges(wait_since, wait_flags & GNUSB_WAIT_ALL);
+	wait_sent = 0;
+	wait_state = WAIT_REPLY;
+	return 0;
+}
+
+uchar usbFunctionRead(uchar *data, uchar len) {
+	u08 i;
+	
+	for (i = 0; i < len && wait_sent < wait_len; i++) {
+		data[i] = changes_reply[wait_sent++];
+	}
+	return i;
+}
+
+
+// ------------------------------------------------------------------------------
+// - usbFunctionDescriptor
+// ------------------------------------------------------------------------------
+// only the serial number is dynamic (see usbconfig.h), it's built in ram
+
+uchar usbFunctionDescriptor(struct usbRequest *rq)
+{
+	usbMsgPtr = (uchar *)serial_descriptor;
+	return (uchar)serial_descriptor[0];
 }
 
 
@@ -79,28 +754,89 @@ void recallPreset(u08 preset) {
 
 uchar usbFunctionSetup(uchar data[8])
 {
-	uchar i;
-			
+	uchar i,len,t;
+	unsigned short now;
+	
+	wait_state = 0;							// a new request: the host has stopped waiting
+	
 	switch (data[1]) {
 	// 								----------------------------  get all values		
 		case GNUSB_CMD_POLL:    
+		case GNUSB_CMD_POLL_CHANGES:
 		
+			hostResync();
+			if (data[1] == GNUSB_CMD_POLL_CHANGES) {
+				usbMsgPtr = changes_reply;
+				return pollChanges(data[2] | (data[3] << 8), data[4]);
+			}
 			usbMsgPtr = led_values;
 	        return sizeof(led_values);
     		break;
     		
+		case GNUSB_CMD_WAIT_CHANGES:
+			wait_since = data[2] | (data[3] << 8);
+			wait_flags = data[4];
+			cli();
+			wait_until = scan_ticks + 8 * data[5];	// whole scans
+			sei();
+			wait_len = 0;
+			wait_state = WAIT_CHANGES;
+			return 0xff;						// usbFunctionReadWait() decides when
+			break;
+			
 		case GNUSB_CMD_SETMODE:
 			
-			button_modes[data[2]] = data[4];
-			eepromWrite(data[2],data[4]);
+			if (data[2] >= 64) break;
+			setMode(data[2], data[4]);
+			break;
+
+		case GNUSB_CMD_COMMIT:
+			modes_committing = 1;
+			break;
+
+		case GNUSB_CMD_SET_AUTOCOMMIT:
+			modes_autocommit = data[2] ? 1 : 0;
+			modes_committing = modes_autocommit;	// off: whatever isn't saved yet waits for COMMIT
 			break;
 			
 		case GNUSB_CMD_STORE_PRESET:
-			storePreset(data[2]);
+			preset_info[0] = storePreset(data[2]);
+			preset_info[1] = data[2];
+			usbMsgPtr = preset_info;
+			return 2;							// if the host asks: whether there was room
 			break;
 			
+		case GNUSB_CMD_GET_PRESETS:
+			preset_info[0] = PRESETS;
+			preset_info[1] = presetsFree() & 0xff;
+			preset_info[2] = presetsFree() >> 8;
+			usbMsgPtr = preset_info;
+			return 3;
+			break;
+
+		case GNUSB_CMD_READ_EVENTS:
+			len = data[7] ? 0xff : data[6];					// as many as the host has room for
+			if (len < 3) break;
+			cli();
+			now = scan_ticks;
+			sei();
+			button_reply[1] = now & 0xff;
+			button_reply[2] = now >> 8;
+			for (i = 0; 3 * i + 6 <= len && i < BUTTON_EVENTS && button_tail != button_head; i++) {
+				t = button_tail++ % BUTTON_EVENTS;
+				button_reply[3 + 3 * i] = button_events[t];
+				button_reply[4 + 3 * i] = button_times[t] & 0xff;
+				button_reply[5 + 3 * i] = button_times[t] >> 8;
+			}
+			button_reply[0] = i | button_lost;
+			button_lost = 0;
+			usbMsgPtr = button_reply;
+			return 3 + 3 * i;
+			break;
+
 		case GNUSB_CMD_RECALL_PRESET:
 			recallPreset(data[2]);
+			report_pending = 1;
 			break;
 
 		case GNUSB_CMD_CLEAR:
@@ -108,6 +844,7 @@ uchar usbFunctionSetup(uchar data[8])
 			for (i = 0; i < 8; i++) {
 				led_values[i] = 0;
 			}
+			report_pending = 1;
 			break;
 			
 		case GNUSB_CMD_SET:
@@ -120,10 +857,27 @@ uchar usbFunctionSetup(uchar data[8])
 		case GNUSB_CMD_SET_ALL_MODES:
 			write_idx = data[4];
 			write_len = data[2];
+			if (write_len > 64) write_len = 64;
 			write_state = WRITE_MODES;
 			return 0xFF;
 			break;
 
+		case GNUSB_CMD_SET_DEBOUNCE:
+			debounce_saved = eepromQueue(DEBOUNCE_ADDRESS, &data[2], 1);
+			if (debounce_saved) setDebounce(data[2]);
+			usbMsgPtr = &debounce_saved;
+			return 1;							// if the host asks: whether it was set
+			break;
+
+		case GNUSB_CMD_SET_SERIAL:
+			write_idx = 0;
+			write_len = data[6];
+			if (write_len > GNUSB_SERIAL_LEN) write_len = GNUSB_SERIAL_LEN;
+			write_state = eepromRoom() ? WRITE_SERIAL : WRITE_REFUSED;
+			if (!write_len && storeSerial(0)) return 0;
+			return 0xFF;						// refused: stalls the data, or times out without any
+			break;
+
 			
 	// 								----------------------------   Start Bootloader for reprogramming the gnusb    		
 		case GNUSB_CMD_START_BOOTLOADER:
@@ -146,21 +900,23 @@ uchar usbFunctionWrite(uchar* data, uchar len)
 {
 
 	uchar* data_end = data + len;
-	uchar i;
 
 	if (write_state == WRITE_VALUES) {
 		for(; (data < data_end) && (write_idx < write_len); ++data, ++write_idx)
 			led_values[write_idx] = *data;
 	}  else if 	(write_state == WRITE_MODES) {
 		for(; (data < data_end) && (write_idx < write_len); ++data, ++write_idx)
-			button_modes[write_idx] = *data;	
+			setMode(write_idx, *data);
+	}  else if 	(write_state == WRITE_SERIAL) {
+		for(; (data < data_end) && (write_idx < write_len); ++data, ++write_idx)
+			serial_descriptor[1 + write_idx] = (*data < 0x20 || *data > 0x7e) ? '_' : *data;
 	} else return 0xff; // stall
 	if(write_idx >= write_len) {
 	
-		if (write_state == WRITE_MODES) {
-			for (i = 0; i < 64; i++) {
-				eepromWrite(i,button_modes[i]);
-			}
+		if (write_state == WRITE_SERIAL) {
+			if (!storeSerial(write_len)) return 0xff;	// eepromRoom() said yes at the setup, but still
+		} else if (write_state == WRITE_VALUES) {
+			report_pending = 1;
 		}
 		
 		return 1;  	// tell driver we've got all data
@@ -171,88 +927,148 @@ uchar usbFunctionWrite(uchar* data, uchar len)
 
 
 // ------------------------------------------------------------------------------
-// - Handle Buttons
+// - Scan the matrix
 // ------------------------------------------------------------------------------
+// timer 0 overflow, ca. every 1.4ms: read the switches of the row selected
+// one overflow ago, they have long settled by now, then light the next row.
+// at the same pace whatever the main loop is busy with. Runs with interrupts
+// enabled so the usb driver can cut in, and leaves everything else to the main
+// loop: a changed row goes to the event queue. When the queue is full the row
+// keeps its old state and counts here, and the next visit tries again
+//
+// debouncing is a vertical counter: every button that reads differently from
+// its debounced state counts up, the others start over, and a button changes
+// once its count reaches the window. the counts are sliced by bit, so the 8
+// buttons of a row take the same few operations as one
 
-void checkButtons(void){
-	u08 i;
+ISR(TIMER0_OVF_vect, ISR_NOBLOCK)
+{
+	u08 row,delta,changed,head;
+	u08 c0,c1,c2;
+	
+	row = mux;
+	delta = halReadSwitches() ^ scan_states[row];
+	mux++;
+	mux = mux % 8;
+	halShowRow(mux, led_values[mux]);
+	scan_ticks++;
 	
-	if (TIFR & (1 << TOV0)) {	// only check buttons on timer overflow
+	c0 = debounce_count[0][row];			// count up where delta, else 0
+	c1 = debounce_count[1][row];
+	c2 = debounce_count[2][row];
+	c2 = (c2 ^ (c1 & c0)) & delta;
+	c1 = (c1 ^ c0) & delta;
+	c0 = ~c0 & delta;
+	changed = delta & ~((c0 ^ debounce_window[0]) | (c1 ^ debounce_window[1]) | (c2 ^ debounce_window[2]));
 	
-		TIFR |= (1 << TOV0); 	// clear timer overflow flag (BY WRITING 1 TO IT, STUPID...) 
+	if (changed) {
+		head = event_head;
+		if ((u08)(head - event_tail) >= SCAN_EVENTS) return;
 		
-		mux++;
-		mux = mux % 8;
-		switch_states_before[mux] = switch_states[mux];
+		scan_states[row] ^= changed;
+		event_row[head % SCAN_EVENTS] = row;
+		event_state[head % SCAN_EVENTS] = scan_states[row];
+		event_time[head % SCAN_EVENTS] = scan_ticks;
+		event_head = head + 1;
+	}
+	debounce_count[0][row] = c0 & ~changed;
+	debounce_count[1][row] = c1 & ~changed;
+	debounce_count[2][row] = c2 & ~changed;
+}
+
+// ------------------------------------------------------------------------------
+// - Handle Buttons
+// ------------------------------------------------------------------------------
 
-		LED_PORT = 0;
-		MUX_PORT = (1 << mux);
-		LED_PORT = led_values[mux];						
+// switches count columns from bit 0, led_values from bit 7
+static const u08 reversed_nibble[16] = {
+	0x0, 0x8, 0x4, 0xc, 0x2, 0xa, 0x6, 0xe, 0x1, 0x9, 0x5, 0xd, 0x3, 0xb, 0x7, 0xf
+};
+
+static inline u08 reverseBits(u08 b) {
+	return (reversed_nibble[b & 0x0f] << 4) | reversed_nibble[b >> 4];
+}
 
-		for (i=0;i<128;i++);
-		switch_states[mux] = ~PINB;						// pullups : 1 = not pressed
+// every press and release waits in button_events[] for the host to read it,
+// so it knows about those that came and went between two polls. when the
+// host doesn't keep up, the oldest go and it gets told so. each one has the
+// scan_ticks of the scan that saw it: a row is read every 8 ticks, so that's
+// when it happened give or take 8 ticks, plus the debounce window
+static void pushEvents(u08 row, u08 buttons, u08 edge, unsigned short time) {
+	u08 col;
 	
-								// debounce all buttons;
-		for (i = 0; i < 64; i++) {
-			if (switch_debounce[i]) switch_debounce[i]--;
+	for (col = 0; buttons; col++, buttons <<= 1) {
+		if (!(buttons & 0x80)) continue;
+		if ((u08)(button_head - button_tail) >= BUTTON_EVENTS) {
+			button_tail++;
+			button_lost = GNUSB_EVENTS_LOST;
 		}
+		button_events[button_head % BUTTON_EVENTS] = (8 * row + col) | edge;
+		button_times[button_head++ % BUTTON_EVENTS] = time;
 	}
+}
 
-	if (switch_states[mux] == switch_states_before[mux]) return; // nothing happened
-
-	u08 btn_idx,trigger_hi,trigger_lo,btn_mode,btn_radio_group;
+void handleRow(u08 row, u08 state, unsigned short time) {
+	u08 i,trigger_hi,trigger_lo,leds,radio;
+	
+	trigger_hi = reverseBits(~switch_states[row] & state);  // lo to high transitions
+	trigger_lo = reverseBits(switch_states[row] & ~state);  // high to lo transitions
+	switch_states[row] = state;
+	if (trigger_hi) pushEvents(row, trigger_hi, GNUSB_EVENT_PRESS, time);
+	if (trigger_lo) pushEvents(row, trigger_lo, 0, time);
+	
+	leds = led_values[row];
+	leds ^= trigger_hi & toggle_mask[row];
+	leds |= trigger_hi & impulse_mask[row];
+	leds &= ~(trigger_lo & impulse_mask[row]);
+	if (leds != led_values[row]) {
+		led_values[row] = leds;
+		report_pending = 1;
+	}
 	
-	trigger_hi = (~switch_states_before[mux] & switch_states[mux]);  // lo to high transitions
-	trigger_lo = (switch_states_before[mux] & ~switch_states[mux]);  // lo to high transitions
-	//usb_reply[mux] = trigger_hi;
+	radio = trigger_hi & radio_row_mask[row];
+	if (!radio) return;
+	for (i = 0; i < 8; i++) {
+		if (!(radio & (1 << (7 - i)))) continue;
+		clearRadioGroup(button_modes[8 * row + i]);
+		led_values[row] |=  (1 << (7 - i));		// turn on this button
+	}
+	report_pending = 1;
+}
 
+// work through what the scan found since the last call
+void checkButtons(void){
+	u08 tail;
 	
-	for (i=0; i<8; i++){
-		btn_idx = 8 * mux + i;
-		btn_mode = (button_modes[btn_idx] & BTN_MODE_MASK);
-		
-		switch (btn_mode) {
-			case BTN_MODE_TOGGLE:
-				if (trigger_hi & (1 << i)) {
-					if (switch_debounce[btn_idx]) break;
-					switch_debounce[btn_idx] = BTN_DEBOUNCE_TOGGLE;  // don't let this button trigger too soon again
-					
-					led_values[mux] ^= (1 << (7 -i));
-					
-				}
-				break;
+	if (masks_stale) buildModeMasks();		// modes came in over usb
+	tail = event_tail;
+	while (tail != event_head) {
+		handleRow(event_row[tail % SCAN_EVENTS], event_state[tail % SCAN_EVENTS], event_time[tail % SCAN_EVENTS]);
+		event_tail = ++tail;
+	}
+}
 
-			case BTN_MODE_RADIO:
-				
-				if (trigger_hi & (1 << i)) {
-
-					u08 row,col;
-					btn_radio_group = button_modes[btn_idx];
-					
-					// turn off all buttons in same group
-					for (row = 0; row < 8; row++) {
-						for (col = 0; col < 8; col++) {
-							if (button_modes[ 8 * row + col] == btn_radio_group) {					
-								led_values[row] &= ~(1 << (7 - col));
-							}	
-						}
-					}
-					
-					// turn on this button
-					led_values[mux] |=  (1 << (7 - i));
-				}
-				break;
+// ------------------------------------------------------------------------------
+// - sendReport
+// ------------------------------------------------------------------------------
+// push led_values to the interrupt endpoint once the previous report has been
+// picked up by the host. a button can flip back before that, so compare against
+// the last report to not send the same state twice
 
-			case BTN_MODE_IMPULSE:
-			
-				if (trigger_hi & (1 << i)) {
-					led_values[mux]  |= (1 << (7 - i));
-				} else if (trigger_lo & (1 << i)) {
-					led_values[mux]  &= ~(1 << (7-i));
-				}
-				break;
+void sendReport(void) {
+	u08 i,changed;
+	
+	if (!report_pending || !usbInterruptIsReady()) return;
+	report_pending = 0;
+	
+	changed = 0;
+	for (i = 0; i < 8; i++) {
+		if (last_report[i] != led_values[i]) {
+			last_report[i] = led_values[i];
+			changed = 1;
 		}
-	}	
+	}
+	if (changed) usbSetInterrupt(last_report, sizeof(last_report));
 }
 
 // ------------------------------------------------------------------------------
@@ -262,30 +1078,22 @@ void checkButtons(void){
 
 void welcomeLights(void) {
  	u08 intro_steps = 128;
-	u08 i;
+	u08 i,tick;
 	
+	tick = scan_ticks;
 	while (intro_steps) {
-		if (TIFR & (1 << TOV0)) {	//timer overflow
-			
-				TIFR |= (1 << TOV0); 	// clear timer overflow flag (BY WRITING 1 TO IT, STUPID...) 
+		if ((u08)(scan_ticks - tick) >= 8) {	// the scan went over all rows
 				
-				mux++;
-				if (mux == 8) {
-					intro_steps--;
-					mux = 0;
-					if ((intro_steps % 4) == 0) {
-						for (i = 0; i < 7; i++) {
-							led_values[i] = led_values[i+1];
-						}
-					led_values[7] = (led_values[7] << 1);
-					if (intro_steps > 64) led_values[7] |= 1;
-
+				tick += 8;
+				intro_steps--;
+				if ((intro_steps % 4) == 0) {
+					for (i = 0; i < 7; i++) {
+						led_values[i] = led_values[i+1];
 					}
+				led_values[7] = (led_values[7] << 1);
+				if (intro_steps > 64) led_values[7] |= 1;
+
 				}
-							
-				LED_PORT = 0;
-				MUX_PORT = (1 << mux);
-				LED_PORT = led_values[mux];						
 			}
 	}	
 }
@@ -302,7 +1110,11 @@ void initState() {
 		//	button_modes[i] = 0x80;//eepromRead(i);
 			button_modes[i] = eepromRead(i);
 	}
+	buildModeMasks();
+	loadPresets();
 	recallPreset(0);
+	loadSerial();
+	setDebounce(eepromRead(DEBOUNCE_ADDRESS));
 }
 
 
@@ -310,19 +1122,15 @@ void initState() {
 // ------------------------------------------------------------------------------
 // gets called before device goes to sleep
 void goodNight() {
-	TCCR0 = 0; 	// stop timer 0 fck/8
-	PORTA = 0;
-	PORTB = 0;	
-	PORTC = 0;
+	halSuspend();
 }
 
 
 // ------------------------------------------------------------------------------
 // gets called before device goes to sleep
 void goodMorning() {
-	TCCR0 = (1 << CS01); 	// start timer 0 fck/8
-	TCCR0 |= (1 << CS00); 	// start timer 0 fck/64
-	PORTB 	= 0xff;		// make sure pull-up resistors are turned ON
+	halResume();
+	halShowRow(mux, led_values[mux]);	// the scan reads this row next
 }
 
 
@@ -338,22 +1146,8 @@ int main(void)
 	mux = 0;
 	// ------------------------- Initialize Hardware
 		
-
-	// PORTA: MUX
-	DDRA 	= 0xff;		// set all pins to output
-	PORTA 	= 0x00;		// all off
-	
-	// PORTB: Switches
-	DDRB 	= 0x00;		// set all pins to input
-	PORTB 	= 0xff;		// make sure pull-up resistors are turned ON
-
-	// PORTC: LEDS
-	DDRC 	= 0xff;		// set all pins to output
-	PORTC 	= 0x00;		// turn off 
-
-
-	TCCR0 = (1 << CS01); 	// start timer 0 fck/8
-	TCCR0 |= (1 << CS00); 	// start timer 0 fck/64
+	halInitPorts();		// PORTA: mux, PORTB: switches, PORTC: leds, timer 0
+	sei();				// the matrix scan runs in the timer interrupt
 	
 	welcomeLights();	// show off a bit
 	initState();
@@ -370,6 +1164,8 @@ int main(void)
 		usbPoll();			// see if there's something going on on the usb bus
 	
 		checkButtons();
+		sendReport();		// tell the host about changed leds
+		eepromPoll();		// write a byte of what usb requests stored
 	}
 	return 0;
 }
@@ -0,0 +1,83 @@
+// ==============================================================================
+// hal_native.c
+// mocked gnusb hardware for the native build
+//
+// Replaces gnusb.c and the usb driver when main.c is built with -DGNUSB_NATIVE:
+// registers are plain variables (see native.h), the eeprom is an array and
+// the interrupt endpoint a buffer. Nothing here sleeps or waits, so whoever
+// drives the firmware decides when timer 0 overflows (by calling its
+// interrupt handler) and when the host picks up a report.
+//
+// License:
+// The project is built with AVR USB driver by Objective Development, which is
+// published under an own licence based on the GNU General Public License (GPL).
+// gnusb is also distributed under this enhanced licence. See Documentation.
+//
+// ==============================================================================
+
+#include "../gnusb.h"
+
+#include <string.h>
+
+// ==============================================================================
+// Registers
+// ------------------------------------------------------------------------------
+
+unsigned char			hal_timer_running;
+unsigned char			hal_switches[8];
+unsigned char			hal_row;
+unsigned char			hal_leds;
+
+unsigned char			hal_eeprom[E2END + 1];
+unsigned long			hal_eeprom_writes;
+
+unsigned char			hal_report[8];
+unsigned char			hal_report_len;
+
+
+// ==============================================================================
+// gnusb.c
+// ------------------------------------------------------------------------------
+
+void eepromWrite(unsigned short addr, unsigned char val)
+{
+	hal_eeprom[addr % (E2END + 1)] = val;
+	hal_eeprom_writes++;
+}
+
+uchar eepromReady(void)
+{
+	return 1;								// writes take no time here
+}
+
+uchar eepromRead(unsigned short addr)
+{
+	return hal_eeprom[addr % (E2END + 1)];
+}
+
+void ledOn(uchar led) {}
+void ledOff(uchar led) {}
+void ledToggle(uchar led) {}
+void initCoreHardware(void) {}
+void sleepIfIdle(void) {}
+void startBootloader(void) {}
+void hadAddressAssigned(void) {}
+
+
+// ==============================================================================
+// usbdrv.c
+// ------------------------------------------------------------------------------
+
+uchar			*usbMsgPtr;
+volatile uchar	usbTxLen1 = USBPID_NAK;		// like the driver: bit 4 set while the buffer is free
+
+void usbInit(void) {}
+void usbPoll(void) {}
+
+void usbSetInterrupt(uchar *data, uchar len)
+{
+	if (len > sizeof(hal_report)) len = sizeof(hal_report);
+	memcpy(hal_report, data, len);
+	hal_report_len = len;
+	usbTxLen1 = len + 4;					// busy until the host picks it up
+}
@@ -0,0 +1,69 @@
+// ==============================================================================
+// native.h
+// gnusbmatrix firmware on the build host
+//
+// gnusb.h includes this instead of avr-libc when built with -DGNUSB_NATIVE.
+// It stands in for the few avr-libc bits the firmware and the usb driver
+// header use, and declares the mocked hardware in hal_native.c that hal.h
+// works on. Programs that drive the firmware (benchmarks, the simulator)
+// set the switches and the timer here and look at what comes out.
+//
+// License:
+// The project is built with AVR USB driver by Objective Development, which is
+// published under an own licence based on the GNU General Public License (GPL).
+// gnusb is also distributed under this enhanced licence. See Documentation.
+//
+// ==============================================================================
+
+#ifndef __native_h_included__
+#define __native_h_included__
+
+// ==============================================================================
+// avr-libc stand-ins
+// ------------------------------------------------------------------------------
+
+#define PROGMEM
+#define pgm_read_byte(addr)		(*(const unsigned char *)(addr))
+
+#define sei()
+#define cli()
+#define ISR(vector, ...)		void vector(void); void vector(void)
+
+#define wdt_reset()
+#define wdt_enable(timeout)
+#define wdt_disable()
+
+#define E2END					0x1FF		// ATmega16: 512 bytes of eeprom
+
+
+// ==============================================================================
+// Mocked hardware, see hal_native.c
+// ------------------------------------------------------------------------------
+
+extern unsigned char			hal_timer_running;		// call TIMER0_OVF_vect() while it is
+extern unsigned char			hal_switches[8];		// pressed buttons per row, 1 = pressed
+extern unsigned char			hal_row;				// row the multiplexer selects
+extern unsigned char			hal_leds;				// what the led port shows for it
+
+extern unsigned char			hal_eeprom[E2END + 1];	// erased (0xff) until written
+extern unsigned long			hal_eeprom_writes;
+
+extern unsigned char			hal_report[8];			// last interrupt report handed to the driver
+extern unsigned char			hal_report_len;			// picked up once usbInterruptIsReady() again
+
+
+// ==============================================================================
+// Firmware entry points (main.c) for whoever drives it
+// ------------------------------------------------------------------------------
+
+extern unsigned char	usbFunctionSetup(unsigned char data[8]);
+extern unsigned char	usbFunctionWrite(unsigned char *data, unsigned char len);
+extern unsigned char	usbFunctionReadWait(void);	// the driver checks it before usbFunctionRead()
+extern unsigned char	usbFunctionRead(unsigned char *data, unsigned char len);
+extern void				checkButtons(void);
+extern void				sendReport(void);
+extern void				initState(void);
+extern void				eepromPoll(void);		// writes one queued eeprom byte
+extern void				TIMER0_OVF_vect(void);	// the matrix scan, once per timer 0 overflow
+
+#endif /* __native_h_included__ */
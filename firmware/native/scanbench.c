@@ -0,0 +1,240 @@
+// ==============================================================================
+// scanbench.c
+// microbenchmark of the gnusbmatrix scan engine, built natively
+//
+// Runs the scan interrupt, checkButtons() and the preset code from main.c on the mocked hardware
+// of hal_native.c and reports what a call costs on the build host, in
+// nanoseconds and, on x86, in TSC cycles. Absolute numbers say little about
+// the ATmega16, but relative ones do: run it before and after a change to the
+// scan code to see whether it got slower, and where.
+//
+// usage: scanbench [calls]		default 100000 calls per scenario
+//
+// License:
+// The project is built with AVR USB driver by Objective Development, which is
+// published under an own licence based on the GNU General Public License (GPL).
+// gnusb is also distributed under this enhanced licence. See Documentation.
+//
+// ==============================================================================
+
+#include "../gnusb.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC	1
+#endif
+
+typedef struct _result
+{
+	double			ns;				// average per call
+	unsigned long	cycles;			// average per call, 0 without TSC
+	unsigned long	max_cycles;		// slowest single call
+} t_result;
+
+// what the scenario does to the switches before each call
+typedef void (*t_stimulus)(unsigned long call);
+
+
+// ==============================================================================
+// Helpers
+// ------------------------------------------------------------------------------
+
+static double now_ns(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static unsigned long long cycles(void)
+{
+#ifdef HAVE_TSC
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+//--------------------------------------------------------------------------
+// send a vendor request like the host would, data stage in 8 byte chunks
+
+static void request(uchar cmd, uchar value, uchar index, uchar *data, uchar len)
+{
+	uchar	setup[8] = { 0x40, cmd, value, 0, index, 0, len, 0 };
+	uchar	chunk[8];
+	uchar	done;
+
+	if (usbFunctionSetup(setup) != 0xff) return;
+	for (done = 0; done < len; done += 8) {
+		memcpy(chunk, data + done, (len - done < 8) ? len - done : 8);
+		if (usbFunctionWrite(chunk, (len - done < 8) ? len - done : 8)) break;
+	}
+}
+
+static void set_all_modes(uchar mode)
+{
+	uchar	modes[64];
+
+	memset(modes, mode, sizeof(modes));
+	request(GNUSB_CMD_SET_ALL_MODES, sizeof(modes), 0, modes, sizeof(modes));
+}
+
+static void reset(uchar mode)
+{
+	int		i;
+
+	memset(hal_switches, 0, sizeof(hal_switches));
+	set_all_modes(mode);
+	request(GNUSB_CMD_SET_DEBOUNCE, 1, 0, NULL, 0);	// every flip counts
+	request(GNUSB_CMD_CLEAR, 0, 0, NULL, 0);
+	for (i = 0; i < 8; i++) TIMER0_OVF_vect();		// the scan sees the released switches
+	checkButtons();
+	for (i = 0; i < 100; i++) eepromPoll();			// the eeprom catches up
+}
+
+
+// ==============================================================================
+// Scenarios
+// ------------------------------------------------------------------------------
+
+static void no_stimulus(unsigned long call) {}
+
+static void tick(unsigned long call)
+{
+	TIMER0_OVF_vect();
+}
+
+// every row flips all of its buttons between two visits: each scan sees
+// eight presses or eight releases
+static void tick_and_flip(unsigned long call)
+{
+	if ((call % 8) == 0) memset(hal_switches, (call / 8) & 1 ? 0x00 : 0xff, sizeof(hal_switches));
+	TIMER0_OVF_vect();
+}
+
+//--------------------------------------------------------------------------
+
+static t_result run(t_stimulus stimulus, unsigned long calls)
+{
+	t_result			r;
+	unsigned long long	c0, c, total_cycles = 0;
+	double				t0;
+	unsigned long		i;
+
+	r.max_cycles = 0;
+	t0 = now_ns();
+	for (i = 0; i < calls; i++) {
+		stimulus(i);
+		c0 = cycles();
+		checkButtons();
+		c = cycles() - c0;
+		total_cycles += c;
+		if (c > r.max_cycles) r.max_cycles = c;
+		sendReport();
+		hal_report_len = 0;
+		usbTxLen1 = USBPID_NAK;					// the host picks up every report right away
+	}
+	r.ns = (now_ns() - t0) / calls;				// includes the stimulus and sendReport()
+	r.cycles = total_cycles / calls;
+	return r;
+}
+
+// the timer interrupt alone, every row changes between two visits
+static t_result run_scan(unsigned long calls)
+{
+	t_result			r;
+	unsigned long long	c0, c, total_cycles = 0;
+	double				t0;
+	unsigned long		i;
+
+	r.max_cycles = 0;
+	t0 = now_ns();
+	for (i = 0; i < calls; i++) {
+		if ((i % 8) == 0) memset(hal_switches, (i / 8) & 1 ? 0x00 : 0xff, sizeof(hal_switches));
+		c0 = cycles();
+		TIMER0_OVF_vect();
+		c = cycles() - c0;
+		total_cycles += c;
+		if (c > r.max_cycles) r.max_cycles = c;
+		checkButtons();							// keeps the event queue from filling up
+	}
+	r.ns = (now_ns() - t0) / calls;				// includes checkButtons()
+	r.cycles = total_cycles / calls;
+	return r;
+}
+
+static void print(const char *name, t_result r)
+{
+#ifdef HAVE_TSC
+	printf("%-36s %8.1f ns %8lu cycles  (max %lu)\n", name, r.ns, r.cycles, r.max_cycles);
+#else
+	printf("%-36s %8.1f ns\n", name, r.ns);
+#endif
+}
+
+
+// ==============================================================================
+// main
+// ------------------------------------------------------------------------------
+
+int main(int argc, char **argv)
+{
+	unsigned long	calls = 100000;
+	unsigned long	i, j;
+	double			t0;
+	uchar			scene[8] = { 0x81, 0, 0, 0x18, 0, 0, 0, 0 };	// two rows lit
+
+	if (argc > 1) calls = strtoul(argv[1], NULL, 10);
+	if (!calls) calls = 1;
+
+	memset(hal_eeprom, 0xff, sizeof(hal_eeprom));
+	initState();
+
+	printf("%lu calls each\n", calls);
+
+	reset(BTN_MODE_IMPULSE);
+	print("scan interrupt, row changes", run_scan(calls));
+
+	printf("checkButtons()\n");
+	print("idle pass, no scan since", run(no_stimulus, calls));
+	print("after a scan, nothing pressed", run(tick, calls));
+	print("after a scan, impulse, 8 change", run(tick_and_flip, calls));
+
+	reset(BTN_MODE_TOGGLE);
+	print("after a scan, toggle, 8 change", run(tick_and_flip, calls));
+
+	reset(BTN_MODE_RADIO | 1);					// worst case: one radio group of 64
+	print("after a scan, radio group of 64", run(tick_and_flip, calls));
+
+	reset(BTN_MODE_IMPULSE);
+	request(GNUSB_CMD_SET, sizeof(scene), 0, scene, sizeof(scene));
+	for (i = 0; i < 16; i++) request(GNUSB_CMD_STORE_PRESET, 16 + i, 0, NULL, 0);
+	for (i = 0; i < 1000; i++) eepromPoll();
+
+	t0 = now_ns();
+	for (i = 0; i < calls; i++) request(GNUSB_CMD_RECALL_PRESET, i % 8, 0, NULL, 0);
+	printf("%-36s %8.1f ns\n", "recall preset, from ram", (now_ns() - t0) / calls);
+
+	t0 = now_ns();
+	for (i = 0; i < calls; i++) request(GNUSB_CMD_RECALL_PRESET, 16 + i % 16, 0, NULL, 0);
+	printf("%-36s %8.1f ns\n", "recall preset, packed in eeprom", (now_ns() - t0) / calls);
+
+	hal_eeprom_writes = 0;
+	t0 = now_ns();
+	for (i = 0; i < calls; i++) {
+		scene[i % 8] ^= 1 << (i % 7);
+		request(GNUSB_CMD_SET, sizeof(scene), 0, scene, sizeof(scene));
+		request(GNUSB_CMD_STORE_PRESET, 16 + i % 16, 0, NULL, 0);
+		for (j = 0; j < 16; j++) eepromPoll();
+	}
+	printf("%-36s %8.1f ns  %lu eeprom writes per call\n", "store preset",
+			(now_ns() - t0) / calls, hal_eeprom_writes / calls);
+
+	return 0;
+}
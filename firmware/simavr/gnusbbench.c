@@ -0,0 +1,459 @@
+// ==============================================================================
+// gnusbbench.c
+// cycle counts of the gnusbmatrix firmware, run under simavr
+//
+// Loads main.bin into a simulated ATmega16 at 12 MHz and runs it from reset.
+// A virtual switch matrix sits on PORTA (rows) and PINB (switches), so
+// button patterns reach the firmware the same way they would on the
+// hardware. USB requests can't come in over the bus here: the driver's
+// bit-banging ISR isn't simulated. So the bench makes the calls the driver
+// would make. It waits until the main loop calls checkButtons() and runs
+// usbFunctionSetup() (and usbFunctionWrite() for the data stage) instead,
+// with the setup packet in usbRxBuf, just like usbPoll() hands it over.
+// Only call-clobbered registers get touched, so the main loop carries on
+// as if checkButtons() had returned.
+//
+// Cycles are counted from a function's first instruction until it returns,
+// and include any interrupts taken in between. Reported against the two
+// budgets V-USB sets at 12 MHz:
+//	- usbPoll() at least every 50ms, ie. the slowest main loop pass
+//	- interrupts never disabled for more than 25 cycles
+//
+// usage: gnusbbench main.bin		(make bench does that)
+//
+// License:
+// The project is built with AVR USB driver by Objective Development, which is
+// published under an own licence based on the GNU General Public License (GPL).
+// gnusb is also distributed under this enhanced licence. See Documentation.
+//
+// ==============================================================================
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <libelf.h>
+#include <gelf.h>
+
+#include "sim_avr.h"
+#include "sim_elf.h"
+#include "sim_io.h"
+#include "avr_ioport.h"
+
+#include "../../common/gnusb_cmds.h"
+
+#define CLOCK				12000000
+#define MS					(CLOCK / 1000)		// cycles
+#define USBPOLL_BUDGET		(50 * MS)			// see usbPoll() in usbdrv.h
+#define CLI_BUDGET			25					// see "Interrupt latency" in usbdrv.h
+#define MAX_DEPTH			16
+#define MAX_DATA			64
+
+// ------------------------------------------------------------------------------
+// what we measure
+
+enum {
+	F_CHECKBUTTONS,
+	F_SCAN,					// TIMER0_OVF_vect
+	F_SETUP,
+	F_WRITE,
+	F_WELCOME,
+	F_LOOP,					// main loop pass: sleepIfIdle() to sleepIfIdle()
+	F_COUNT
+};
+
+static const char *function_names[F_COUNT] = {
+	"checkButtons", "__vector_9", "usbFunctionSetup", "usbFunctionWrite", "welcomeLights", "sleepIfIdle"
+};
+
+typedef struct _stat
+{
+	unsigned long		calls;
+	avr_cycle_count_t	total;
+	avr_cycle_count_t	max;
+} t_stat;
+
+typedef struct _frame
+{
+	int					function;
+	int					tag;			// stat to book it on
+	uint16_t			sp;				// at entry: returned once SP is above it again
+	avr_cycle_count_t	start;
+} t_frame;
+
+// ------------------------------------------------------------------------------
+// usb requests to play, one after the other
+
+typedef struct _request
+{
+	const char			*name;
+	uint8_t				cmd;
+	uint8_t				value;
+	uint8_t				index;
+	uint8_t				len;			// bytes in the data stage, or to read
+	uint8_t				data[MAX_DATA];
+} t_request;
+
+static t_request	requests[] = {
+	{ "POLL",			GNUSB_CMD_POLL,				0, 0, 0 },
+	{ "SETMODE",		GNUSB_CMD_SETMODE,			5, BTN_MODE_TOGGLE, 0 },
+	{ "CLEAR",			GNUSB_CMD_CLEAR,			0, 0, 0 },
+	{ "SET",			GNUSB_CMD_SET,				8, 0, 8 },
+	{ "SET_ALL_MODES",	GNUSB_CMD_SET_ALL_MODES,	64, 0, 64 },
+	{ "STORE_PRESET",	GNUSB_CMD_STORE_PRESET,		1, 0, 0 },
+	{ "RECALL_PRESET",	GNUSB_CMD_RECALL_PRESET,	1, 0, 0 },
+	{ "SET_SERIAL",		GNUSB_CMD_SET_SERIAL,		0, 0, 8, "BENCH001" },
+	{ "READ_EVENTS",	GNUSB_CMD_READ_EVENTS,		0, 0, 1 + GNUSB_EVENTS_MAX },
+	{ "POLL_CHANGES",	GNUSB_CMD_POLL_CHANGES,		0, 0, GNUSB_CHANGES_HEADER + 8 },
+	{ "WAIT_CHANGES",	GNUSB_CMD_WAIT_CHANGES,		0, GNUSB_WAIT_ALL, GNUSB_CHANGES_HEADER + 8 },
+};
+#define REQUESTS	(int)(sizeof(requests) / sizeof(requests[0]))
+
+// ------------------------------------------------------------------------------
+
+static avr_t			*avr;
+static uint32_t			entry[F_COUNT];		// flash byte addresses, 0 -> not in the binary
+static uint16_t			rxbuf;				// usbRxBuf in sram
+static t_stat			stats[F_COUNT];
+static t_stat			setup_stats[REQUESTS], write_stats[REQUESTS];
+static t_frame			stack[MAX_DEPTH];
+static int				depth;
+static avr_cycle_count_t	last_loop;
+
+static uint8_t			matrix[8];			// pressed buttons per row
+static avr_irq_t		*switch_pins[8];
+
+static avr_cycle_count_t	cli_start, cli_max;
+static uint32_t			cli_max_pc;
+static int				sei_seen;
+
+
+// ==============================================================================
+// Symbols
+// ------------------------------------------------------------------------------
+
+static int read_symbols(const char *path)
+{
+	Elf				*elf;
+	Elf_Scn			*scn = NULL;
+	Elf_Data		*data;
+	GElf_Shdr		shdr;
+	GElf_Sym		sym;
+	const char		*name;
+	int				fd, i, n, f;
+
+	elf_version(EV_CURRENT);
+	if ((fd = open(path, O_RDONLY)) < 0) return 0;
+	elf = elf_begin(fd, ELF_C_READ, NULL);
+	while (elf && (scn = elf_nextscn(elf, scn))) {
+		gelf_getshdr(scn, &shdr);
+		if (shdr.sh_type != SHT_SYMTAB) continue;
+		data = elf_getdata(scn, NULL);
+		n = shdr.sh_size / shdr.sh_entsize;
+		for (i = 0; i < n; i++) {
+			gelf_getsym(data, i, &sym);
+			name = elf_strptr(elf, shdr.sh_link, sym.st_name);
+			if (!name) continue;
+			for (f = 0; f < F_COUNT; f++) {
+				if (GELF_ST_TYPE(sym.st_info) == STT_FUNC && !strcmp(name, function_names[f])) entry[f] = sym.st_value;
+			}
+			if (!strcmp(name, "usbRxBuf")) rxbuf = sym.st_value & 0xffff;	// data lives at 0x800000
+		}
+	}
+	if (elf) elf_end(elf);
+	close(fd);
+	return (entry[F_CHECKBUTTONS] && entry[F_SETUP] && rxbuf);
+}
+
+
+// ==============================================================================
+// Switch matrix
+// ------------------------------------------------------------------------------
+// the firmware selects a row on PORTA, the switches of that row pull PINB low
+
+static void update_switches(uint8_t rows)
+{
+	uint8_t		pressed = 0;
+	int			row, i;
+
+	for (row = 0; row < 8; row++) {
+		if (rows & (1 << row)) pressed |= matrix[row];
+	}
+	for (i = 0; i < 8; i++) {
+		avr_raise_irq(switch_pins[i], (pressed & (1 << i)) ? 0 : 1);
+	}
+}
+
+static void mux_changed(struct avr_irq_t *irq, uint32_t value, void *param)
+{
+	update_switches(value);
+}
+
+static void set_matrix(const uint8_t *rows)
+{
+	memcpy(matrix, rows, sizeof(matrix));
+	update_switches(avr->data[0x3b]);			// PORTA
+}
+
+
+// ==============================================================================
+// Stepping
+// ------------------------------------------------------------------------------
+
+static uint16_t sp(void)
+{
+	return avr->data[R_SPL] | (avr->data[R_SPH] << 8);
+}
+
+static void book(t_stat *s, avr_cycle_count_t cycles)
+{
+	s->calls++;
+	s->total += cycles;
+	if (cycles > s->max) s->max = cycles;
+}
+
+//--------------------------------------------------------------------------
+// called after every instruction: function entries and returns, cli stretches
+
+static void watch(void)
+{
+	avr_cycle_count_t	cycles;
+	int					f;
+
+	// returned? the return address has been popped off
+	while (depth && sp() > stack[depth - 1].sp) {
+		depth--;
+		cycles = avr->cycle - stack[depth].start;
+		f = stack[depth].function;
+		if (f == F_SETUP) book(&setup_stats[stack[depth].tag], cycles);
+		else if (f == F_WRITE) book(&write_stats[stack[depth].tag], cycles);
+		book(&stats[f], cycles);
+	}
+
+	for (f = 0; f < F_COUNT; f++) {
+		if (!entry[f] || avr->pc != entry[f]) continue;
+		if (f == F_LOOP) {
+			if (last_loop) book(&stats[F_LOOP], avr->cycle - last_loop);
+			last_loop = avr->cycle;
+		} else if (depth < MAX_DEPTH) {
+			stack[depth].function = f;
+			stack[depth].tag = 0;
+			stack[depth].sp = sp();
+			stack[depth].start = avr->cycle;
+			depth++;
+		}
+	}
+
+	if (!avr->sreg[S_I]) {
+		if (!cli_start) cli_start = avr->cycle;
+	} else {
+		if (cli_start && sei_seen && avr->cycle - cli_start > cli_max) {
+			cli_max = avr->cycle - cli_start;
+			cli_max_pc = avr->pc;
+		}
+		cli_start = 0;
+		sei_seen = 1;							// before that: reset and startup, doesn't count
+	}
+}
+
+//--------------------------------------------------------------------------
+
+static int step(void)
+{
+	int		state = avr_run(avr);
+
+	watch();
+	return (state != cpu_Done && state != cpu_Crashed);
+}
+
+static int run_for(avr_cycle_count_t cycles)
+{
+	avr_cycle_count_t	until = avr->cycle + cycles;
+
+	while (avr->cycle < until) {
+		if (!step()) return 0;
+	}
+	return 1;
+}
+
+//--------------------------------------------------------------------------
+// run until the main loop calls checkButtons(), then call fn instead.
+// arguments as avr-gcc passes them: pointer in r25:r24, byte in r22
+// -> returns the function's return value (r24)
+
+static int call_instead(int fn, int tag, uint16_t arg_ptr, uint8_t arg_byte)
+{
+	int		at;
+
+	while (avr->pc != entry[F_CHECKBUTTONS] || depth != 1) {	// checkButtons just pushed
+		if (!step()) return -1;
+	}
+	depth = 0;									// it never runs
+
+	avr->data[24] = arg_ptr & 0xff;
+	avr->data[25] = arg_ptr >> 8;
+	avr->data[22] = arg_byte;
+	avr->pc = entry[fn];
+	watch();
+	at = depth;
+	stack[at - 1].tag = tag;
+
+	while (depth >= at) {
+		if (!step()) return -1;
+	}
+	return avr->data[24];
+}
+
+//--------------------------------------------------------------------------
+// one vendor request, the way usbPoll() would deliver it
+
+static void play_request(int n)
+{
+	t_request	*r = &requests[n];
+	uint8_t		setup[8] = { 0x40, r->cmd, r->value, 0, r->index, 0, r->len, 0 };
+	int			done, chunk, reply;
+
+	if (r->cmd == GNUSB_CMD_POLL || r->cmd == GNUSB_CMD_READ_EVENTS || r->cmd == GNUSB_CMD_POLL_CHANGES
+		|| r->cmd == GNUSB_CMD_WAIT_CHANGES) setup[0] = 0xc0;
+	memcpy(avr->data + rxbuf + 1, setup, 8);	// after the PID
+	reply = call_instead(F_SETUP, n, rxbuf + 1, 0);
+	if (reply != 0xff || (setup[0] & 0x80)) return;
+
+	for (done = 0; done < r->len; done += 8) {
+		chunk = (r->len - done < 8) ? r->len - done : 8;
+		memcpy(avr->data + rxbuf + 1, r->data + done, chunk);
+		if (call_instead(F_WRITE, n, rxbuf + 1, chunk) != 0) break;
+	}
+}
+
+
+// ==============================================================================
+// Report
+// ------------------------------------------------------------------------------
+
+static void print_stat(const char *name, t_stat *s)
+{
+	if (!s->calls) {
+		printf("  %-30s never called (inlined?)\n", name);
+		return;
+	}
+	printf("  %-30s %8lu calls  avg %8.0f  max %8lu cycles  (max %7.1f us)\n", name, s->calls,
+			(double)s->total / s->calls, (unsigned long)s->max, s->max * 1e6 / CLOCK);
+}
+
+static void print_phase(const char *name)
+{
+	printf("%s\n", name);
+	print_stat("scan interrupt", &stats[F_SCAN]);
+	print_stat("checkButtons()", &stats[F_CHECKBUTTONS]);
+	print_stat("main loop pass", &stats[F_LOOP]);
+	memset(&stats[F_SCAN], 0, sizeof(t_stat));
+	memset(&stats[F_CHECKBUTTONS], 0, sizeof(t_stat));
+	memset(&stats[F_LOOP], 0, sizeof(t_stat));
+	last_loop = 0;
+}
+
+
+// ==============================================================================
+// main
+// ------------------------------------------------------------------------------
+
+int main(int argc, char **argv)
+{
+	elf_firmware_t	f;
+	uint8_t			rows[8], modes[64];
+	avr_cycle_count_t	worst_loop = 0;
+	char			name[64];
+	int				i, n;
+
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s main.bin\n", argv[0]);
+		return 1;
+	}
+	memset(&f, 0, sizeof(f));
+	if (elf_read_firmware(argv[1], &f) != 0 || !read_symbols(argv[1])) {
+		fprintf(stderr, "gnusbbench: can't read %s, or it lacks symbols\n", argv[1]);
+		return 1;
+	}
+	avr = avr_make_mcu_by_name("atmega16");
+	if (!avr) {
+		fprintf(stderr, "gnusbbench: simavr has no atmega16\n");
+		return 1;
+	}
+	avr_init(avr);
+	avr->frequency = CLOCK;
+	avr_load_firmware(avr, &f);
+
+	for (i = 0; i < 8; i++) {
+		switch_pins[i] = avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), i);
+	}
+	avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('A'), IOPORT_IRQ_PIN_ALL), mux_changed, NULL);
+	memset(rows, 0, sizeof(rows));
+	set_matrix(rows);
+
+	printf("gnusbbench: %s on %s @ %d MHz\n\n", argv[1], avr->mmcu, CLOCK / 1000000);
+
+	// ----------------------------------------------------- startup
+	while (!stats[F_WELCOME].calls && entry[F_WELCOME]) {	// the light show runs ca. 1.4s
+		if (!step()) return 1;
+	}
+	if (!run_for(100 * MS)) return 1;
+	printf("startup\n");
+	print_stat("welcomeLights()", &stats[F_WELCOME]);
+	print_phase("idle, 100ms");
+
+	// ----------------------------------------------------- usb requests
+	printf("usb requests\n");
+	for (n = 0; n < REQUESTS; n++) {
+		play_request(n);
+		run_for(MS);
+	}
+	for (n = 0; n < REQUESTS; n++) {
+		snprintf(name, sizeof(name), "setup %s", requests[n].name);
+		print_stat(name, &setup_stats[n]);
+		if (write_stats[n].calls) {
+			snprintf(name, sizeof(name), "write %s", requests[n].name);
+			print_stat(name, &write_stats[n]);
+		}
+	}
+	if (stats[F_LOOP].max > worst_loop) worst_loop = stats[F_LOOP].max;
+	print_phase("main loop around them");
+
+	// ----------------------------------------------------- button patterns
+	// every row flips all of its buttons every 40ms, in each mode. that's
+	// longer than the default debounce window, so every flip counts
+	for (i = 0; i < 3; i++) {
+		static const uint8_t	mode[3] = { BTN_MODE_IMPULSE, BTN_MODE_TOGGLE, BTN_MODE_RADIO | 1 };
+		static const char		*mode_name[3] = { "impulse, all rows flipping", "toggle, all rows flipping",
+													"radio, one group of 64, all rows flipping" };
+
+		memset(modes, mode[i], sizeof(modes));
+		requests[4].len = sizeof(modes);
+		memcpy(requests[4].data, modes, sizeof(modes));
+		play_request(4);						// SET_ALL_MODES
+		memset(&stats[F_SCAN], 0, sizeof(t_stat));
+		memset(&stats[F_CHECKBUTTONS], 0, sizeof(t_stat));
+		memset(&stats[F_LOOP], 0, sizeof(t_stat));
+		last_loop = 0;
+
+		for (n = 0; n < 25; n++) {
+			memset(rows, (n & 1) ? 0x00 : 0xff, sizeof(rows));
+			set_matrix(rows);
+			if (!run_for(40 * MS)) return 1;
+		}
+		if (stats[F_LOOP].max > worst_loop) worst_loop = stats[F_LOOP].max;
+		print_phase(mode_name[i]);
+	}
+
+	// ----------------------------------------------------- budgets
+	printf("\nbudgets\n");
+	printf("  slowest main loop pass         %8lu cycles  %7.2f ms of %d ms for usbPoll()  %s\n",
+			(unsigned long)worst_loop, worst_loop * 1000. / CLOCK, USBPOLL_BUDGET / MS,
+			worst_loop < USBPOLL_BUDGET ? "ok" : "TOO SLOW");
+	printf("  longest cli stretch            %8lu cycles  of %d, ended at 0x%04x  %s\n",
+			(unsigned long)cli_max, CLI_BUDGET, cli_max_pc, cli_max <= CLI_BUDGET ? "ok" : "TOO LONG");
+
+	avr_terminate(avr);
+	return (worst_loop < USBPOLL_BUDGET && cli_max <= CLI_BUDGET) ? 0 : 2;
+}
@@ -545,6 +545,10 @@ uchar   i;
     }
     if(usbTxLen & 0x10){ /* transmit system idle */
         if(usbMsgLen != 0xff){  /* transmit data pending? */
+#if USB_CFG_IMPLEMENT_FN_READ && defined(USB_READ_WAIT_HOOK)
+            /* gnusbmatrix: usbFunctionRead() may hold back its data, see usbdrv.h */
+            if((usbMsgFlags & USB_FLG_USE_DEFAULT_RW) || !USB_READ_WAIT_HOOK())
+#endif
             usbBuildTxBlock();
         }
     }
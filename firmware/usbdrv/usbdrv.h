@@ -261,6 +261,14 @@ USB_PUBLIC uchar usbFunctionRead(uchar *data, uchar len);
  * In order to get usbFunctionRead() called, define USB_CFG_IMPLEMENT_FN_READ
  * to 1 in usbconfig.h and return 0xff in usbFunctionSetup()..
  */
+#ifdef USB_READ_WAIT_HOOK
+USB_PUBLIC uchar usbFunctionReadWait(void);
+/* gnusbmatrix addition: if usbconfig.h defines USB_READ_WAIT_HOOK, the driver
+ * asks it before every usbFunctionRead() call. As long as it returns non-zero,
+ * the data stage is not started and the host's IN tokens are NAKed. That way
+ * a request can wait for something to happen. A new SETUP ends the wait.
+ */
+#endif
 #endif /* USB_CFG_IMPLEMENT_FN_READ */
 #if USB_CFG_IMPLEMENT_FN_WRITEOUT
 USB_PUBLIC void usbFunctionWriteOut(uchar *data, uchar len);
@@ -18,7 +18,7 @@
 #include "ext_common.h"
 
 #include "../common/GNUSB_CMDs.h"		// codes used between gnusbmatrix client and host software, eg. between the max external and the gnusbmatrix firmware
-#include </usr/local/include/usb.h>     // this is libusb, see http://libusb.sourceforge.net/ */
+#include "../common/gnusb_device.h"		// one usb thread per device, shared by all objects in the process
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -28,27 +28,39 @@
 // Constants
 // ------------------------------------------------------------------------------
 
-#define USBDEV_SHARED_VENDOR    	0x16C0  /* VOTI */
-#define USBDEV_SHARED_PRODUCT   	0x05DC  /* Obdev's free shared PID */
 #define OUTLETS 					9
 #define DEFAULT_CLOCK_INTERVAL		40		// default interval for polling the gnusbmatrix: 40ms
+#define DRAIN_INTERVAL				2		// how often the scheduler looks for replies from the usb thread
+#define PLAYOUT_EVENTS				64		// button events waiting for their time, must be a power of 2
 
 // ==============================================================================
 // Our External's Memory structure
 // ------------------------------------------------------------------------------
 
+typedef struct _playout						// a button event waiting to be output
+{
+	unsigned char	event[GNUSB_MSG_EVENT_LEN];
+	double			at;						// logical time of the scheduler
+} t_playout;
+
 typedef struct _gnusbmatrix				// defines our object's internal variables for each instance in a patch
 {
 	t_object 		p_ob;					// object header - ALL max external MUST begin with this...
-	usb_dev_handle	*dev_handle;			// handle to the gnusbmatrix usb device
 	void			*m_clock;				// handle to our clock
 	double 			m_interval;				// clock interval for polling the gnusbmatrix
-	double 			m_interval_bak;			// backup clock interval for polling the gnusbmatrix
 	int				is_running;				// is our clock ticking?
-	int				do_10_bit;				// output analog values with 8bit or 10bit resolution?
+	int				is_connected;			// last thing the usb thread told us
 	int				debug_flag;
 	void 			*outlets[OUTLETS];		// handle to the objects outlets
 	int 			values[8];				// stored values from last poll
+	int				presets;				// preset slots the matrix has
+	unsigned int	events_start;			// device time of the first event since "events 1"
+	int				events_started;
+	double			latency;				// ms after they happened events come out, 0 -> when they arrive
+	void			*playout_clock;
+	t_playout		playout[PLAYOUT_EVENTS];
+	unsigned int	playout_head, playout_tail;
+	t_gnusb_client	client;					// our line to the usb thread of the gnusbmatrix
 } t_gnusbmatrix;
 
 void *gnusbmatrix_class;					// global pointer to the object class - so max can reference the object 
@@ -58,7 +70,8 @@ void *gnusbmatrix_class;					// global pointer to the object class - so max can
 // Function Prototypes
 // ------------------------------------------------------------------------------
 
-void *gnusbmatrix_new		(t_symbol *s);
+void *gnusbmatrix_new		(t_symbol *s, short ac, t_atom *av);
+void gnusbmatrix_free		(t_gnusbmatrix *x);
 
 void gnusbmatrix_assist		(t_gnusbmatrix *x, void *b, long m, long a, char *s);
 void gnusbmatrix_bang		(t_gnusbmatrix *x);				
@@ -66,6 +79,8 @@ void gnusbmatrix_clear		(t_gnusbmatrix *x);
 void gnusbmatrix_close		(t_gnusbmatrix *x);
 void gnusbmatrix_debug		(t_gnusbmatrix *x,  long n);
 void gnusbmatrix_int		(t_gnusbmatrix *x,long n);
+void gnusbmatrix_interrupt	(t_gnusbmatrix *x, long n);
+void gnusbmatrix_longpoll	(t_gnusbmatrix *x, long n);
 void gnusbmatrix_open		(t_gnusbmatrix *x);
 void gnusbmatrix_poll		(t_gnusbmatrix *x, long n);
 void gnusbmatrix_recall		(t_gnusbmatrix *x, long n);
@@ -75,10 +90,20 @@ void gnusbmatrix_stop		(t_gnusbmatrix *x);
 void gnusbmatrix_store		(t_gnusbmatrix *x, long n);
 void gnusbmatrix_list		(t_gnusbmatrix *x, t_symbol *s, short ac, t_atom *av);
 void gnusbmatrix_setmodes	(t_gnusbmatrix *x, t_symbol *s, short ac, t_atom *av);
+void gnusbmatrix_setserial	(t_gnusbmatrix *x, t_symbol *s);
+void gnusbmatrix_debounce	(t_gnusbmatrix *x, long n);
+void gnusbmatrix_commit		(t_gnusbmatrix *x);
+void gnusbmatrix_autocommit	(t_gnusbmatrix *x, long n);
+void gnusbmatrix_events		(t_gnusbmatrix *x, long n);
+void gnusbmatrix_latency	(t_gnusbmatrix *x, double f);
+void gnusbmatrix_tick		(t_gnusbmatrix *x);
+void gnusbmatrix_playout	(t_gnusbmatrix *x);
 
-// functions used to find the USB device
-static int  	usbGetStringAscii(usb_dev_handle *dev, int index, int langid, char *buf, int buflen);
-void 			find_device(t_gnusbmatrix *x);
+// talking to the usb thread
+static void 	send_command(t_gnusbmatrix *x, int type, int request, int value, int index, unsigned char *data, int len);
+static void 	output_values(t_gnusbmatrix *x, unsigned char *buffer);
+static void 	output_events(t_gnusbmatrix *x, unsigned char *events, int len);
+static void 	output_event(t_gnusbmatrix *x, unsigned char *event);
 
 
 
@@ -92,11 +117,7 @@ void 			find_device(t_gnusbmatrix *x);
 //--------------------------------------------------------------------------
 
 void gnusbmatrix_clear		(t_gnusbmatrix *x){
-	if (!(x->dev_handle)) find_device(x);
-	else {
-		usb_control_msg(x->dev_handle, USB_TYPE_VENDOR | USB_RECIP_DEVICE | USB_ENDPOINT_IN, 
-							GNUSB_CMD_CLEAR, 0, 0, NULL, 0 , 1000);
-	}
+	send_command(x, GNUSB_MSG_CONTROL, GNUSB_CMD_CLEAR, 0, 0, NULL, 0);
 }
 
 //--------------------------------------------------------------------------
@@ -109,7 +130,6 @@ void gnusbmatrix_list(t_gnusbmatrix *x, t_symbol *s, short ac, t_atom *av)
 {
 	int i;
 	unsigned char  		buffer[8];
-	int                 nBytes;
 
 	if (ac > 8) ac = 8;
 	
@@ -120,12 +140,7 @@ void gnusbmatrix_list(t_gnusbmatrix *x, t_symbol *s, short ac, t_atom *av)
 				buffer[i] = 0;
 		}
 
-	if (!(x->dev_handle)) find_device(x);
-	else {
-
-		nBytes = usb_control_msg(x->dev_handle, USB_TYPE_VENDOR | USB_RECIP_DEVICE | USB_ENDPOINT_OUT,
-									GNUSB_CMD_SET, ac, 0, buffer, ac, 1000);
-	}
+	send_command(x, GNUSB_MSG_CONTROL, GNUSB_CMD_SET, ac, 0, buffer, ac);
 }
 
 //--------------------------------------------------------------------------
@@ -133,13 +148,11 @@ void gnusbmatrix_list(t_gnusbmatrix *x, t_symbol *s, short ac, t_atom *av)
 //--------------------------------------------------------------------------
 
 void gnusbmatrix_recall		(t_gnusbmatrix *x, long n){
-	if (n <  0) n =  0;
-	if (n > 50) n = 50;	
-	if (!(x->dev_handle)) find_device(x);
-	else {
-		usb_control_msg(x->dev_handle, USB_TYPE_VENDOR | USB_RECIP_DEVICE | USB_ENDPOINT_IN, 
-							GNUSB_CMD_RECALL_PRESET, n, 0, NULL, 0 , 1000);
+	if (n < 0 || n >= x->presets) {
+		post("gnusbmatrix: no preset %ld, the matrix has 0 to %d", n, x->presets - 1);
+		return;
 	}
+	send_command(x, GNUSB_MSG_CONTROL, GNUSB_CMD_RECALL_PRESET, n, 0, NULL, 0);
 }
 
 
@@ -147,13 +160,11 @@ void gnusbmatrix_recall		(t_gnusbmatrix *x, long n){
 // - Message: store 		-> store a preset
 //--------------------------------------------------------------------------
 void gnusbmatrix_store		(t_gnusbmatrix *x, long n){
-	if (n <  0) n =  0;
-	if (n > 50) n = 50;	
-	if (!(x->dev_handle)) find_device(x);
-	else {
-		usb_control_msg(x->dev_handle, USB_TYPE_VENDOR | USB_RECIP_DEVICE | USB_ENDPOINT_IN, 
-							GNUSB_CMD_STORE_PRESET, n, 0, NULL, 0 , 1000);
+	if (n < 0 || n >= x->presets) {
+		post("gnusbmatrix: no preset %ld, the matrix has 0 to %d", n, x->presets - 1);
+		return;
 	}
+	send_command(x, GNUSB_MSG_QUERY, GNUSB_CMD_STORE_PRESET, n, 0, NULL, 2);	// the answer says if it fit
 }
 
 //--------------------------------------------------------------------------
@@ -184,11 +195,7 @@ void gnusbmatrix_setmode	(t_gnusbmatrix *x, long btn, t_symbol *mode, long radio
 	}
 		post ("mode %d\n",themode);
 
-	if (!(x->dev_handle)) find_device(x);
-	else {
-		usb_control_msg(x->dev_handle, USB_TYPE_VENDOR | USB_RECIP_DEVICE | USB_ENDPOINT_IN, 
-							GNUSB_CMD_SETMODE, (unsigned char)btn, (unsigned char)themode, NULL, 0 , 1000);
-	}
+	send_command(x, GNUSB_MSG_CONTROL, GNUSB_CMD_SETMODE, (unsigned char)btn, (unsigned char)themode, NULL, 0);
 }
 
 //--------------------------------------------------------------------------
@@ -199,9 +206,8 @@ void gnusbmatrix_setmodes	(t_gnusbmatrix *x, t_symbol *s, short ac, t_atom *av){
 	
 	if (ac > 64) ac = 64;
 	
-	int 	i;
-	char* 	buf = malloc( ac );
-	int                 nBytes;
+	int 			i;
+	unsigned char 	buf[64];
 
 
 	for(i=0; i<ac; ++i,av++) {
@@ -211,12 +217,74 @@ void gnusbmatrix_setmodes	(t_gnusbmatrix *x, t_symbol *s, short ac, t_atom *av){
 			buf[i] = 0;
 	}
 
-	if (!(x->dev_handle)) find_device(x);
-	else {
+	send_command(x, GNUSB_MSG_CONTROL, GNUSB_CMD_SET_ALL_MODES, ac, 0, buf, ac);
+}
+
+//--------------------------------------------------------------------------
+// - Message: serial	 		-> give the matrix a serial number, takes effect after replugging
+//--------------------------------------------------------------------------
+
+void gnusbmatrix_setserial	(t_gnusbmatrix *x, t_symbol *s){
+	int len;
 	
-		nBytes = usb_control_msg(x->dev_handle, USB_TYPE_VENDOR | USB_RECIP_DEVICE | USB_ENDPOINT_OUT,
-									GNUSB_CMD_SET_ALL_MODES, ac, 0, buf, ac, 1000);
+	len = strlen(s->s_name);
+	if (len > GNUSB_SERIAL_LEN) {
+		post ("gnusbmatrix: serial number too long, using the first %d characters", GNUSB_SERIAL_LEN);
+		len = GNUSB_SERIAL_LEN;
 	}
+	send_command(x, GNUSB_MSG_CONTROL, GNUSB_CMD_SET_SERIAL, 0, 0, (unsigned char *)s->s_name, len);
+}
+
+//--------------------------------------------------------------------------
+// - Message: debounce	 		-> scans a button change has to last, 1 (off) to 7
+//--------------------------------------------------------------------------
+
+void gnusbmatrix_debounce	(t_gnusbmatrix *x, long n){
+	if (n < 1) n = 1;
+	if (n > GNUSB_DEBOUNCE_MAX) n = GNUSB_DEBOUNCE_MAX;
+	send_command(x, GNUSB_MSG_QUERY, GNUSB_CMD_SET_DEBOUNCE, n, 0, NULL, 1);	// the answer says if it was set
+}
+
+//--------------------------------------------------------------------------
+// - Message: commit	 		-> save changed button modes in the matrix
+//--------------------------------------------------------------------------
+
+void gnusbmatrix_commit		(t_gnusbmatrix *x){
+	send_command(x, GNUSB_MSG_CONTROL, GNUSB_CMD_COMMIT, 0, 0, NULL, 0);
+}
+
+//--------------------------------------------------------------------------
+// - Message: autocommit	 	-> 1 saves mode changes right away (default), 0 waits for commit
+//--------------------------------------------------------------------------
+
+void gnusbmatrix_autocommit	(t_gnusbmatrix *x, long n){
+	send_command(x, GNUSB_MSG_CONTROL, GNUSB_CMD_SET_AUTOCOMMIT, (n != 0), 0, NULL, 0);
+}
+
+//--------------------------------------------------------------------------
+// - Message: events	 	-> 1 outputs every press and release as "event x y 1/0 ms" too
+//--------------------------------------------------------------------------
+// the matrix keeps them between polls, so even a tap shorter than the poll
+// interval shows up. they share the outlet of the "x y state" lists. ms is
+// when the matrix saw it, counted from the first event: the time between two
+// events is the time between the presses, whenever the poll picks them up
+
+void gnusbmatrix_events		(t_gnusbmatrix *x, long n){
+	x->events_started = 0;
+	x->playout_tail = x->playout_head;				// forget what is still waiting
+	clock_unset(x->playout_clock);
+	send_command(x, GNUSB_MSG_EVENTS, 0, (n != 0), 0, NULL, 0);
+}
+
+//--------------------------------------------------------------------------
+// - Message: latency	 	-> events come out this many ms after they happened, 0 (default) as they arrive
+//--------------------------------------------------------------------------
+// the usb thread knows when they happened on the computer's clock, from the
+// clock of the matrix. with a latency longer than the poll interval they keep
+// the timing they were played with, instead of bunching up at every poll
+
+void gnusbmatrix_latency	(t_gnusbmatrix *x, double f){
+	x->latency = MAX(f, 0.);
 }
 
 //--------------------------------------------------------------------------
@@ -228,50 +296,32 @@ void gnusbmatrix_debug(t_gnusbmatrix *x, long n)	// x = the instance of the obje
 	if (n)	x->debug_flag = 1;
 	else 	x->debug_flag = 0;
 }
+//--------------------------------------------------------------------------
+// - Message: interrupt	-> 1 reads change reports from the interrupt endpoint, 0 polls
+//--------------------------------------------------------------------------
+
+void gnusbmatrix_interrupt(t_gnusbmatrix *x, long n)
+{
+	send_command(x, GNUSB_MSG_INTERRUPT, 0, (n != 0), 0, NULL, 0);
+}
+
+//--------------------------------------------------------------------------
+// - Message: longpoll	-> 1 (default) without the interrupt endpoint, the device answers once something changes; 0 polls
+//--------------------------------------------------------------------------
+
+void gnusbmatrix_longpoll(t_gnusbmatrix *x, long n)
+{
+	send_command(x, GNUSB_MSG_WAIT, 0, (n != 0), 0, NULL, 0);
+}
+
 //--------------------------------------------------------------------------
 // - Message: bang  -> poll the gnusbmatrix
 //--------------------------------------------------------------------------
 
 void gnusbmatrix_bang(t_gnusbmatrix *x)	// poll the gnusbmatrix
 {
-	int                 nBytes,i,n;
-	int					temp;
-	unsigned char       buffer[8];
-	t_atom				myList[3];
-	t_atom				bitList[8];
-
-	
-	if (!(x->dev_handle)) find_device(x);
-	else {
-		// ask the gnusbmatrix to send us data
-		nBytes = usb_control_msg(x->dev_handle, USB_TYPE_VENDOR | USB_RECIP_DEVICE | USB_ENDPOINT_IN, 
-									GNUSB_CMD_POLL, 0, 0, (char *)buffer, sizeof(buffer), 10);
-		// let's see what has come back...							
-		if(nBytes < sizeof(buffer)){
-			if (x->debug_flag) {
-				if(nBytes < 0)
-					post( "USB error: %s\n", usb_strerror());
-				post( "only %d bytes status received\n", nBytes);
-			}
-		} else {
-			for (i = 0; i < 8; i++) {
-				temp = buffer[i];
-					
-				if (x->values[i] != temp) {					// output if value has changed
-					
-					SETLONG(myList+1,7-i);
-					for (n=0; n < 8; n++) {
-						SETLONG(myList,n);
-						SETLONG(myList+2,((temp & (1 << n)) != 0));
-						SETLONG(bitList+n,((temp & (1 << n)) != 0));
-						outlet_list(x->outlets[8], 0L,3,&myList);
-					}
-					outlet_list(x->outlets[i], 0L,8,&bitList);					
-				x->values[i] = temp;
-				}
-			}
-		}
-	}
+	send_command(x, GNUSB_MSG_POLL, 0, 0, 0, NULL, 0);
+	if (!x->is_running) clock_fdelay(x->m_clock, DRAIN_INTERVAL);	// pick up the answer
 }
 
 
@@ -281,9 +331,12 @@ void gnusbmatrix_bang(t_gnusbmatrix *x)	// poll the gnusbmatrix
 
 void gnusbmatrix_open(t_gnusbmatrix *x)
 {
-	if (x->dev_handle) {
+	if (x->is_connected) {
 		post("gnusbmatrix: There is already a connection to www.anyma.ch/gnusbmatrix",0);
-	} else find_device(x);
+	} else {
+		send_command(x, GNUSB_MSG_OPEN, 0, 0, 0, NULL, 0);
+		if (!x->is_running) clock_fdelay(x->m_clock, DRAIN_INTERVAL);
+	}
 }
 
 //--------------------------------------------------------------------------
@@ -292,12 +345,8 @@ void gnusbmatrix_open(t_gnusbmatrix *x)
 
 void gnusbmatrix_close(t_gnusbmatrix *x)
 {
-	if (x->dev_handle) {
-		usb_close(x->dev_handle);
-		x->dev_handle = NULL;
-		post("gnusbmatrix: Closed connection to www.anyma.ch/gnusbmatrix",0);
-	} else
-		post("gnusbmatrix: There was no open connection to www.anyma.ch/gnusbmatrix",0);
+	send_command(x, GNUSB_MSG_CLOSE, 0, 0, 0, NULL, 0);
+	if (!x->is_running) clock_fdelay(x->m_clock, DRAIN_INTERVAL);
 }
 
 //--------------------------------------------------------------------------
@@ -307,8 +356,8 @@ void gnusbmatrix_close(t_gnusbmatrix *x)
 void gnusbmatrix_poll(t_gnusbmatrix *x, long n){
 	if (n > 0) { 
 		x->m_interval = n;
-		x->m_interval_bak = n;
-		gnusbmatrix_start(x);
+		if (x->is_running) send_command(x, GNUSB_MSG_INTERVAL, 0, n, 0, NULL, 0);
+		else gnusbmatrix_start(x);
 	} else {
 		gnusbmatrix_stop(x);
 	}
@@ -333,6 +382,7 @@ void gnusbmatrix_int(t_gnusbmatrix *x,long n) {
 
 void gnusbmatrix_start (t_gnusbmatrix *x) { 
 	if (!x->is_running) {
+		send_command(x, GNUSB_MSG_INTERVAL, 0, (int)x->m_interval, 0, NULL, 0);
 		clock_fdelay(x->m_clock,0.);
 		x->is_running  = 1;
 	}
@@ -345,7 +395,7 @@ void gnusbmatrix_start (t_gnusbmatrix *x) {
 void gnusbmatrix_stop (t_gnusbmatrix *x) { 
 	if (x->is_running) {
 		x->is_running  = 0;
-		clock_unset(x->m_clock); 
+		send_command(x, GNUSB_MSG_INTERVAL, 0, 0, 0, NULL, 0);
 		gnusbmatrix_close(x);
 	}
 } 
@@ -355,22 +405,90 @@ void gnusbmatrix_stop (t_gnusbmatrix *x) {
 //--------------------------------------------------------------------------
 // - The clock is ticking, tic, tac...
 //--------------------------------------------------------------------------
+// the usb thread does the polling, the clock only hands its replies to the patch
 
 void gnusbmatrix_tick(t_gnusbmatrix *x) { 
-	clock_fdelay(x->m_clock, x->m_interval); 	// schedule another tick
-	gnusbmatrix_bang(x); 								// poll the gnusbmatrix
+	t_gnusb_msg		msg;
+
+	if (x->is_running || gnusb_client_busy(&x->client))
+		clock_fdelay(x->m_clock, DRAIN_INTERVAL); 	// schedule another tick
+
+	while (gnusb_queue_pop(&x->client.replies, &msg)) {
+		switch (msg.type) {
+			case GNUSB_MSG_VALUES:
+				output_values(x, msg.data);
+				break;
+			case GNUSB_MSG_FOUND:
+				x->is_connected = 1;
+				if (msg.len > 1) post("gnusbmatrix: Found USB device www.anyma.ch/gnusbmatrix, serial number %s", msg.data);
+				else post("gnusbmatrix: Found USB device www.anyma.ch/gnusbmatrix");
+				x->presets = GNUSB_PRESETS_OLD;			// unless it tells us otherwise
+				x->events_started = 0;					// its clock starts over
+				send_command(x, GNUSB_MSG_QUERY, GNUSB_CMD_GET_PRESETS, 0, 0, NULL, 3);
+				break;
+			case GNUSB_MSG_BUTTONS:
+				if (msg.value) post("gnusbmatrix: lost button events, poll faster");
+				output_events(x, msg.data, msg.len);
+				break;
+			case GNUSB_MSG_ANSWER:
+				if (msg.request == GNUSB_CMD_GET_PRESETS && msg.len >= 1) {
+					x->presets = msg.data[0];
+					if (x->debug_flag) post("gnusbmatrix: %d presets", x->presets);
+					if (x->debug_flag && msg.len >= 3) post("gnusbmatrix: %d bytes free for presets", msg.data[1] | (msg.data[2] << 8));
+				}
+				if (msg.request == GNUSB_CMD_STORE_PRESET && msg.len >= 2 && !msg.data[0])
+					post("gnusbmatrix: preset %d not stored, no room (the matrix may be making some, try again)", msg.data[1]);
+				if (msg.request == GNUSB_CMD_SET_DEBOUNCE && msg.len >= 1 && !msg.data[0])
+					post("gnusbmatrix: debounce not set, the matrix is busy saving (try again)");
+				break;
+			case GNUSB_MSG_NOT_FOUND:
+				x->is_connected = 0;
+				post("gnusbmatrix: Could not find USB device www.anyma.ch/gnusbmatrix");
+				break;
+			case GNUSB_MSG_CLOSED:
+				x->is_connected = 0;
+				if (msg.value) post("gnusbmatrix: Closed connection to www.anyma.ch/gnusbmatrix",0);
+				else post("gnusbmatrix: There was no open connection to www.anyma.ch/gnusbmatrix",0);
+				break;
+			case GNUSB_MSG_ERROR:
+				if (x->debug_flag) post("gnusbmatrix: USB error %d on request %d", msg.value, msg.request);
+				if (msg.request == GNUSB_CMD_SET_SERIAL) post("gnusbmatrix: serial number not set, the matrix is busy saving (try again)");
+				break;
+		}
+	}
 } 
 
 
+//--------------------------------------------------------------------------
+// - Events whose time has come
+//--------------------------------------------------------------------------
+
+void gnusbmatrix_playout(t_gnusbmatrix *x) {
+	t_playout	*p;
+	double		now;
+
+	clock_getftime(&now);
+	while (x->playout_head != x->playout_tail) {
+		p = x->playout + (x->playout_tail & (PLAYOUT_EVENTS - 1));
+		if (p->at > now) {
+			clock_fdelay(x->playout_clock, p->at - now);
+			break;
+		}
+		x->playout_tail++;
+		output_event(x, p->event);
+	}
+}
+
+
 //--------------------------------------------------------------------------
 // - Object creation and setup
 //--------------------------------------------------------------------------
 
 int main(void)
 {
-	setup((t_messlist **)&gnusbmatrix_class, (method)gnusbmatrix_new, 0L, (short)sizeof(t_gnusbmatrix), 0L, A_DEFSYM, 0); 
+	setup((t_messlist **)&gnusbmatrix_class, (method)gnusbmatrix_new, (method)gnusbmatrix_free, (short)sizeof(t_gnusbmatrix), 0L, A_GIMME, 0);
 	// setup() loads our external into Max's memory so it can be used in a patch
-	// gnusbmatrix_new = object creation method defined below, A_DEFLONG = its (optional) arguement is a long (32-bit) int 
+	// gnusbmatrix_new = object creation method defined below, A_GIMME = its (optional) arguement is a serial number or an index
 	
 															// Add message handlers
 	addbang((method)gnusbmatrix_bang);
@@ -387,29 +505,51 @@ int main(void)
 	addmess((method)gnusbmatrix_stop, "stop", 0);	
 	addmess((method)gnusbmatrix_clear, "clear", 0);	
 	addmess((method)gnusbmatrix_setmodes, "modes", A_GIMME,0);	
+	addmess((method)gnusbmatrix_interrupt, "interrupt", A_DEFLONG,0);	
+	addmess((method)gnusbmatrix_longpoll, "longpoll", A_DEFLONG,0);	
+	addmess((method)gnusbmatrix_setserial, "serial", A_SYM,0);	
+	addmess((method)gnusbmatrix_debounce, "debounce", A_DEFLONG,0);	
+	addmess((method)gnusbmatrix_commit, "commit", 0);	
+	addmess((method)gnusbmatrix_autocommit, "autocommit", A_DEFLONG,0);	
+	addmess((method)gnusbmatrix_events, "events", A_DEFLONG,0);	
+	addmess((method)gnusbmatrix_latency, "latency", A_DEFFLOAT,0);	
 	
 	return 1;
 }
 
 //--------------------------------------------------------------------------
 
-void *gnusbmatrix_new(t_symbol *s)		// s = optional argument typed into object box (A_SYM) -- defaults to 0 if no args are typed
+void *gnusbmatrix_new(t_symbol *s, short ac, t_atom *av)	// optional argument: serial number (symbol) or index (int) of the matrix to use
 {
 	t_gnusbmatrix *x;										// local variable (pointer to a t_gnusbmatrix data structure)
+	char		*serial = NULL;
+	int			index = 0;
 
 	x = (t_gnusbmatrix *)newobject(gnusbmatrix_class); 			// create a new instance of this object
 	x->m_clock = clock_new(x,(method)gnusbmatrix_tick); 	// make new clock for polling and attach gnsub_tick function to it
 	
 	x->m_interval = DEFAULT_CLOCK_INTERVAL;
-	x->m_interval_bak = DEFAULT_CLOCK_INTERVAL;
-
+	x->is_running = 0;
+	x->is_connected = 0;
 	x->debug_flag = 0;
-	x->dev_handle = NULL;
+	x->presets = GNUSB_PRESETS_OLD;
+	x->events_started = 0;
+	x->latency = 0.;
+	x->playout_clock = clock_new(x,(method)gnusbmatrix_playout);
+	x->playout_head = x->playout_tail = 0;
 	int i;
 													// create outlets and assign it to our outlet variable in the instance's data structure
 	for (i=0; i < OUTLETS; i++) {
 		x->outlets[i] = listout(x);	
-	}	
+	}
+
+	// which unit: a serial number, else the n-th one we find.
+	// objects asking for the same unit share its connection
+	if (ac && av->a_type == A_SYM) serial = av->a_w.w_sym->s_name;
+	else if (ac && av->a_type == A_LONG) index = MAX(av->a_w.w_long, 0);
+
+	if (!gnusb_client_attach(&x->client, "gnusbmatrix", serial, index, 8, 1))
+		error("gnusbmatrix: could not start usb thread");
 
 	return x;					// return a reference to the object instance 
 }
@@ -422,100 +562,104 @@ void *gnusbmatrix_new(t_symbol *s)		// s = optional argument typed into object b
 
 void gnusbmatrix_free(t_gnusbmatrix *x)
 {
-	if (x->dev_handle) usb_close(x->dev_handle);
+	gnusb_client_detach(&x->client);				// the last one closes the device
 	freeobject((t_object *)x->m_clock);  			// free the clock
+	freeobject((t_object *)x->playout_clock);
 }
 
 
-
-
-
 //--------------------------------------------------------------------------
-// - USB Utility Functions
+// - Scheduler side of the usb thread
 //--------------------------------------------------------------------------
 
+static void send_command(t_gnusbmatrix *x, int type, int request, int value, int index, unsigned char *data, int len)
+{
+	if (!x->client.device) return;
+	if (!gnusb_client_send(&x->client, type, request, value, index, data, len))
+		error("gnusbmatrix: usb thread is busy, dropped command");
+}
 
-static int  usbGetStringAscii(usb_dev_handle *dev, int index, int langid, char *buf, int buflen)
+//--------------------------------------------------------------------------
+
+static void output_values(t_gnusbmatrix *x, unsigned char *buffer)
 {
-char    buffer[256];
-int     rval, i;
-
-    if((rval = usb_control_msg(dev, USB_ENDPOINT_IN, USB_REQ_GET_DESCRIPTOR, (USB_DT_STRING << 8) + index, langid, buffer, sizeof(buffer), 1000)) < 0)
-        return rval;
-    if(buffer[1] != USB_DT_STRING)
-        return 0;
-    if((unsigned char)buffer[0] < rval)
-        rval = (unsigned char)buffer[0];
-    rval /= 2;
-    /* lossy conversion to ISO Latin1 */
-    for(i=1;i<rval;i++){
-        if(i > buflen)  /* destination buffer overflow */
-            break;
-        buf[i-1] = buffer[2 * i];
-        if(buffer[2 * i + 1] != 0)  /* outside of ISO Latin1 range */
-            buf[i-1] = '?';
-    }
-    buf[i-1] = 0;
-    return i-1;
+	int                 i,n;
+	int					temp;
+	t_atom				myList[3];
+	t_atom				bitList[8];
+
+	for (i = 0; i < 8; i++) {
+		temp = buffer[i];
+
+		if (x->values[i] != temp) {					// output if value has changed
+
+			SETLONG(myList+1,7-i);
+			for (n=0; n < 8; n++) {
+				SETLONG(myList,n);
+				SETLONG(myList+2,((temp & (1 << n)) != 0));
+				SETLONG(bitList+n,((temp & (1 << n)) != 0));
+				outlet_list(x->outlets[8], 0L,3,myList);
+			}
+			outlet_list(x->outlets[i], 0L,8,bitList);
+		x->values[i] = temp;
+		}
+	}
 }
 
 //--------------------------------------------------------------------------
+// with a latency, every event waits until it is that old. late ones and
+// the ones that don't fit the queue come out right away, in order
 
+static void output_events(t_gnusbmatrix *x, unsigned char *events, int len)
+{
+	t_playout			*p;
+	double				now, at, last;
+
+	clock_getftime(&now);
+	last = now;
+	if (x->playout_head != x->playout_tail) last = x->playout[(x->playout_head - 1) & (PLAYOUT_EVENTS - 1)].at;
+
+	for (; len >= GNUSB_MSG_EVENT_LEN; events += GNUSB_MSG_EVENT_LEN, len -= GNUSB_MSG_EVENT_LEN) {
+		at = now + x->latency - gnusb_client_event_age(events);
+		if (!x->latency || (at <= now && x->playout_head == x->playout_tail)) {
+			output_event(x, events);
+			continue;
+		}
+		if (x->playout_head - x->playout_tail == PLAYOUT_EVENTS) {
+			if (x->debug_flag) post("gnusbmatrix: too many events waiting, latency too long?");
+			gnusbmatrix_playout(x);
+			if (x->playout_head - x->playout_tail == PLAYOUT_EVENTS) {
+				output_event(x, x->playout[x->playout_tail & (PLAYOUT_EVENTS - 1)].event);
+				x->playout_tail++;
+			}
+		}
+		p = x->playout + (x->playout_head & (PLAYOUT_EVENTS - 1));
+		memcpy(p->event, events, GNUSB_MSG_EVENT_LEN);
+		p->at = last = MAX(at, last);				// the estimate moves a little, the order doesn't
+		x->playout_head++;
+	}
+	gnusbmatrix_playout(x);
+}
 
-void find_device(t_gnusbmatrix *x)
+//--------------------------------------------------------------------------
+// same x and y as the values: button 8 * r + c lights bit 7 - c of row r,
+// so it comes out as x = 7 - c, y = 7 - r
+
+static void output_event(t_gnusbmatrix *x, unsigned char *event)
 {
-	usb_dev_handle      *handle = NULL;
-	struct usb_bus      *bus;
-	struct usb_device   *dev;
-	
-	usb_find_busses();
-    usb_find_devices();
-	 for(bus=usb_busses; bus; bus=bus->next){
-        for(dev=bus->devices; dev; dev=dev->next){
-            if(dev->descriptor.idVendor == USBDEV_SHARED_VENDOR && dev->descriptor.idProduct == USBDEV_SHARED_PRODUCT){
-                char    string[256];
-                int     len;
-                handle = usb_open(dev); /* we need to open the device in order to query strings */
-                if(!handle){
-                    error ("Warning: cannot open USB device: %s", usb_strerror());
-                    continue;
-                }
-                /* now find out whether the device actually is gnusbmatrix */
-                len = usbGetStringAscii(handle, dev->descriptor.iManufacturer, 0x0409, string, sizeof(string));
-                if(len < 0){
-                    post("gnusbmatrix: warning: cannot query manufacturer for device: %s", usb_strerror());
-                    goto skipDevice;
-                }
-                
-			//	post("gnusbmatrix: seen device from vendor ->%s<-", string); 
-                if(strcmp(string, "www.anyma.ch") != 0)
-                    goto skipDevice;
-                len = usbGetStringAscii(handle, dev->descriptor.iProduct, 0x0409, string, sizeof(string));
-                if(len < 0){
-                    post("gnusbmatrix: warning: cannot query product for device: %s", usb_strerror());
-                    goto skipDevice;
-                }
-              //  post("gnusbmatrix: seen product ->%s<-", string);
-                if(strcmp(string, "gnusbmatrix") == 0)
-                    break;
-skipDevice:
-                usb_close(handle);
-                handle = NULL;
-            }
-        }
-        if(handle)
-            break;
-    }
-	
-    if(!handle){
-        post("gnusbmatrix: Could not find USB device www.anyma.ch/gnusbmatrix");
-		x->dev_handle = NULL;
-		if (x->m_interval < 10000) x->m_interval *=2; // throttle polling down to max 20s if we can't find a gnusbmatrix
-	} else {
-		x->dev_handle = handle;
-		 post("gnusbmatrix: Found USB device www.anyma.ch/gnusbmatrix");
-		 x->m_interval = x->m_interval_bak;			// restore original polling interval
-		 if (x->is_running) gnusbmatrix_tick(x);
-		 else gnusbmatrix_bang(x);
+	int					button;
+	unsigned int		time;
+	t_atom				myList[4];
+
+	time = event[1] | (event[2] << 8) | (event[3] << 16) | ((unsigned int)event[4] << 24);
+	if (!x->events_started) {
+		x->events_start = time;
+		x->events_started = 1;
 	}
-}
\ No newline at end of file
+	button = event[0] & GNUSB_EVENT_BUTTON;
+	SETLONG(myList, 7 - button % 8);
+	SETLONG(myList+1, 7 - button / 8);
+	SETLONG(myList+2, (event[0] & GNUSB_EVENT_PRESS) != 0);
+	SETFLOAT(myList+3, (float)((time - x->events_start) * GNUSB_TICK_MS));
+	outlet_anything(x->outlets[8], gensym("event"), 4, myList);
+}
@@ -17,7 +17,7 @@
 #include "m_pd.h"
 
 #include "../common/gnusb_cmds.h"		// codes used between gnusb client and host software, eg. between the max external and the gnusb firmware
-#include </usr/local/include/usb.h>     // this is libusb, see http://libusb.sourceforge.net/ */
+#include "../common/gnusb_device.h"		// one usb thread per device, shared by all objects in the process
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -27,10 +27,10 @@
 // Constants
 // ------------------------------------------------------------------------------
 
-#define USBDEV_SHARED_VENDOR    	0x16C0  /* VOTI */
-#define USBDEV_SHARED_PRODUCT   	0x05DC  /* Obdev's free shared PID */
 #define OUTLETS 					10
 #define DEFAULT_CLOCK_INTERVAL		40		// default interval for polling the gnusb: 40ms
+#define DRAIN_INTERVAL				2		// how often the scheduler looks for replies from the usb thread
+#define POLL_LEN					12		// 10 values + 2 bytes of stuffed 10bit LSBs
 
 // ==============================================================================
 // Our External's Memory structure
@@ -39,15 +39,15 @@
 typedef struct _gnusb				// defines our object's internal variables for each instance in a patch
 {
 	t_object 		p_ob;					// object header - ALL max external MUST begin with this...
-	usb_dev_handle	*dev_handle;			// handle to the gnusb usb device
 	void			*m_clock;				// handle to our clock
 	double 			m_interval;				// clock interval for polling the gnusb
-	double 			m_interval_bak;			// backup clock interval for polling the gnusb
 	int				is_running;				// is our clock ticking?
+	int				is_connected;			// last thing the usb thread told us
 	int				do_10_bit;				// output analog values with 8bit or 10bit resolution?
 	int				debug_flag;
 	void 			*outlets[OUTLETS];		// handle to the objects outlets
 	int 			values[10];				// stored values from last poll
+	t_gnusb_client	client;					// our line to the usb thread of the gnusb
 } t_gnusb;
 
 void *gnusb_class;					// global pointer to the object class - so max can reference the object 
@@ -58,6 +58,7 @@ void *gnusb_class;					// global pointer to the object class - so max can refere
 // ------------------------------------------------------------------------------
 
 void *gnusb_new(t_symbol *s);
+void gnusb_free(t_gnusb *x);
 void gnusb_assist(t_gnusb *x, void *b, long m, long a, char *s);
 void gnusb_bang(t_gnusb *x);				
 void gnusb_close(t_gnusb *x);
@@ -71,10 +72,11 @@ void gnusb_poll(t_gnusb *x, long n);
 void gnusb_smooth(t_gnusb *x, long n);
 void gnusb_start(t_gnusb *x);
 void gnusb_stop(t_gnusb *x);
+void gnusb_tick(t_gnusb *x);
 
-// functions used to find the USB device
-static int  	usbGetStringAscii(usb_dev_handle *dev, int index, int langid, char *buf, int buflen);
-void 			find_device(t_gnusb *x);
+// talking to the usb thread
+static void 	send_command(t_gnusb *x, int type, int request, int value, int index, unsigned char *data, int len);
+static void 	output_values(t_gnusb *x, unsigned char *buffer);
 
 
 
@@ -91,8 +93,6 @@ void 			find_device(t_gnusb *x);
 void gnusb_output(t_gnusb *x, t_symbol *s, long n)
 {
 	int cmd;
-	int nBytes;
-	unsigned char buffer[8];
 	
 	cmd = 0;
 	if (s == gensym("b")) cmd = GNUSB_CMD_SET_PORTB;
@@ -105,13 +105,7 @@ void gnusb_output(t_gnusb *x, t_symbol *s, long n)
 	if (n < 0) n = 0;
 	if (n > 255) n = 255;
 	
-	if (!(x->dev_handle)) find_device(x);
-	else {
-		nBytes = usb_control_msg(x->dev_handle, USB_TYPE_VENDOR | USB_RECIP_DEVICE | USB_ENDPOINT_IN, 
-							cmd, n, 0, (char *)buffer, sizeof(buffer), 10);
-	}
-
-	
+	send_command(x, GNUSB_MSG_CONTROL, cmd, n, 0, NULL, 0);
 }
 
 //--------------------------------------------------------------------------
@@ -121,8 +115,6 @@ void gnusb_output(t_gnusb *x, t_symbol *s, long n)
 void gnusb_input(t_gnusb *x, t_symbol *s)
 {
 	int cmd;
-	int nBytes;
-	unsigned char buffer[8];
 	
 	cmd = 0;
 	if (s == gensym("b")) cmd = GNUSB_CMD_INPUT_PORTB;
@@ -132,13 +124,7 @@ void gnusb_input(t_gnusb *x, t_symbol *s)
 		return;
 	}
 	
-	if (!(x->dev_handle)) find_device(x);
-	else {
-		nBytes = usb_control_msg(x->dev_handle, USB_TYPE_VENDOR | USB_RECIP_DEVICE | USB_ENDPOINT_IN, 
-							cmd, 0, 0, (char *)buffer, sizeof(buffer), 10);
-	}
-
-	
+	send_command(x, GNUSB_MSG_CONTROL, cmd, 0, 0, NULL, 0);
 }
 
 //--------------------------------------------------------------------------
@@ -167,53 +153,8 @@ void gnusb_debug(t_gnusb *x, long n)	// x = the instance of the object; n = the
 
 void gnusb_bang(t_gnusb *x)	// poll the gnusb
 {
-	int                 nBytes,i,n;
-	int 				replymask,replyshift,replybyte;
-	int					temp;
-	unsigned char       buffer[12];
-	
-	if (!(x->dev_handle)) find_device(x);
-	else {
-			// ask the gnusb to send us data
-			nBytes = usb_control_msg(x->dev_handle, USB_TYPE_VENDOR | USB_RECIP_DEVICE | USB_ENDPOINT_IN, 
-										GNUSB_CMD_POLL, 0, 0, (char *)buffer, sizeof(buffer), 10);
-			// let's see what has come back...							
-			if(nBytes < sizeof(buffer)){
-				if (x->debug_flag) {
-					if(nBytes < 0)
-						post( "USB error: %s\n", usb_strerror());
-					post( "only %d bytes status received\n", nBytes);
-				}
-			} else {
-				for (i = 0; i < OUTLETS; i++) {
-					// n = OUTLETS - i - 1; // on max/msp outlets are reversed
-					n = i;
-					temp = buffer[n];
-					
-					
-															// add 2 stuffed bits from end of buffer if we're doing 10bit precision
-					if (n < 8) {
-						if (x->do_10_bit) {
-							
-							if (n < 4)  replybyte = buffer[10];
-							else replybyte = buffer[11];
-							
-							replyshift = ((n % 4) * 2);			// how much to shift the bits
-							replymask = (3 << replyshift);
-							
-							temp = temp * 4 + ((replybyte & replymask) >> replyshift);	// add 2 LSB
-							
-						}
-					}
-					
-					if (x->values[i] != temp) {					// output if value has changed
-//max						outlet_int(x->outlets[i], temp);
-						outlet_float(x->outlets[i], temp);
-						x->values[i] = temp;
-					}
-				}
-			}
-	}
+	send_command(x, GNUSB_MSG_POLL, 0, 0, 0, NULL, 0);
+	if (!x->is_running) clock_delay(x->m_clock, DRAIN_INTERVAL);	// pick up the answer
 }
 
 
@@ -223,9 +164,12 @@ void gnusb_bang(t_gnusb *x)	// poll the gnusb
 
 void gnusb_open(t_gnusb *x)
 {
-	if (x->dev_handle) {
+	if (x->is_connected) {
 		post("gnusb: There is already a connection to www.anyma.ch/gnusb",0);
-	} else find_device(x);
+	} else {
+		send_command(x, GNUSB_MSG_OPEN, 0, 0, 0, NULL, 0);
+		if (!x->is_running) clock_delay(x->m_clock, DRAIN_INTERVAL);
+	}
 }
 
 //--------------------------------------------------------------------------
@@ -234,12 +178,8 @@ void gnusb_open(t_gnusb *x)
 
 void gnusb_close(t_gnusb *x)
 {
-	if (x->dev_handle) {
-		usb_close(x->dev_handle);
-		x->dev_handle = NULL;
-		post("gnusb: Closed connection to www.anyma.ch/gnusb",0);
-	} else
-		post("gnusb: There was no open connection to www.anyma.ch/gnusb",0);
+	send_command(x, GNUSB_MSG_CLOSE, 0, 0, 0, NULL, 0);
+	if (!x->is_running) clock_delay(x->m_clock, DRAIN_INTERVAL);
 }
 
 //--------------------------------------------------------------------------
@@ -249,8 +189,8 @@ void gnusb_close(t_gnusb *x)
 void gnusb_poll(t_gnusb *x, long n){
 	if (n > 0) { 
 		x->m_interval = n;
-		x->m_interval_bak = n;
-		gnusb_start(x);
+		if (x->is_running) send_command(x, GNUSB_MSG_INTERVAL, 0, n, 0, NULL, 0);
+		else gnusb_start(x);
 	} else {
 		gnusb_stop(x);
 	}
@@ -261,18 +201,10 @@ void gnusb_poll(t_gnusb *x, long n){
 //--------------------------------------------------------------------------
 
 void gnusb_smooth(t_gnusb *x, long n) {
-	int nBytes;
-	unsigned char buffer[8];
-
 	if (n < 0) n = 0;
 	if (n > 15) n = 15;
 
-	if (!(x->dev_handle)) find_device(x);
-	else {
-		nBytes = usb_control_msg(x->dev_handle, USB_TYPE_VENDOR | USB_RECIP_DEVICE | USB_ENDPOINT_IN, 
-							GNUSB_CMD_SET_SMOOTHING, n, 0, (char *)buffer, sizeof(buffer), 10);
-	}
-
+	send_command(x, GNUSB_MSG_CONTROL, GNUSB_CMD_SET_SMOOTHING, n, 0, NULL, 0);
 }
 
 //--------------------------------------------------------------------------
@@ -293,6 +225,7 @@ void gnusb_int(t_gnusb *x,long n) {
 
 void gnusb_start (t_gnusb *x) { 
 	if (!x->is_running) {
+		send_command(x, GNUSB_MSG_INTERVAL, 0, (int)x->m_interval, 0, NULL, 0);
 		clock_delay(x->m_clock,0.);
 		x->is_running  = 1;
 	}
@@ -305,7 +238,7 @@ void gnusb_start (t_gnusb *x) {
 void gnusb_stop (t_gnusb *x) { 
 	if (x->is_running) {
 		x->is_running  = 0;
-		clock_unset(x->m_clock); 
+		send_command(x, GNUSB_MSG_INTERVAL, 0, 0, 0, NULL, 0);
 		gnusb_close(x);
 	}
 } 
@@ -315,11 +248,37 @@ void gnusb_stop (t_gnusb *x) {
 //--------------------------------------------------------------------------
 // - The clock is ticking, tic, tac...
 //--------------------------------------------------------------------------
+// the usb thread does the polling, the clock only hands its replies to the patch
 
 void gnusb_tick(t_gnusb *x) { 
-//	clock_fdelay(x->m_clock, x->m_interval); 	// schedule another tick
-	clock_delay(x->m_clock, x->m_interval); 	// schedule another tick
-	gnusb_bang(x); 								// poll the gnusb
+	t_gnusb_msg		msg;
+
+	if (x->is_running || gnusb_client_busy(&x->client))
+		clock_delay(x->m_clock, DRAIN_INTERVAL); 	// schedule another tick
+
+	while (gnusb_queue_pop(&x->client.replies, &msg)) {
+		switch (msg.type) {
+			case GNUSB_MSG_VALUES:
+				output_values(x, msg.data);
+				break;
+			case GNUSB_MSG_FOUND:
+				x->is_connected = 1;
+				post("gnusb: Found USB device www.anyma.ch/gnusb");
+				break;
+			case GNUSB_MSG_NOT_FOUND:
+				x->is_connected = 0;
+				post("gnusb: Could not find USB device www.anyma.ch/gnusb");
+				break;
+			case GNUSB_MSG_CLOSED:
+				x->is_connected = 0;
+				if (msg.value) post("gnusb: Closed connection to www.anyma.ch/gnusb",0);
+				else post("gnusb: There was no open connection to www.anyma.ch/gnusb",0);
+				break;
+			case GNUSB_MSG_ERROR:
+				if (x->debug_flag) post("gnusb: USB error %d on request %d", msg.value, msg.request);
+				break;
+		}
+	}
 } 
 
 
@@ -330,7 +289,7 @@ void gnusb_tick(t_gnusb *x) {
 int gnusb_setup(void)
 {
 
-	gnusb_class = class_new ( gensym("gnusb"),(t_newmethod)gnusb_new, 0, sizeof(t_gnusb), 	CLASS_DEFAULT,0);
+	gnusb_class = class_new ( gensym("gnusb"),(t_newmethod)gnusb_new, (t_method)gnusb_free, sizeof(t_gnusb), 	CLASS_DEFAULT,0);
 
 	// setup() loads our external into Max's memory so it can be used in a patch
 	// gnusb_new = object creation method defined below, A_DEFLONG = its (optional) arguement is a long (32-bit) int 
@@ -369,16 +328,19 @@ void *gnusb_new(t_symbol *s)		// s = optional argument typed into object box (A_
 	else  x->do_10_bit = 0;
 	
 	x->m_interval = DEFAULT_CLOCK_INTERVAL;
-	x->m_interval_bak = DEFAULT_CLOCK_INTERVAL;
-
+	x->is_running = 0;
+	x->is_connected = 0;
 	x->debug_flag = 0;
-	x->dev_handle = NULL;
 	int i;
 													// create outlets and assign it to our outlet variable in the instance's data structure
 	for (i=0; i < OUTLETS; i++) {
 		x->outlets[i] = outlet_new(&x->p_ob, &s_float);
 //max		x->outlets[i] = intout(x);	
-	}	
+	}
+
+	// all gnusb objects in the process share one connection
+	if (!gnusb_client_attach(&x->client, "gnusb", NULL, 0, POLL_LEN, 0))
+		error("gnusb: could not start usb thread");
 
 	return x;					// return a reference to the object instance 
 }
@@ -391,103 +353,56 @@ void *gnusb_new(t_symbol *s)		// s = optional argument typed into object box (A_
 
 void gnusb_free(t_gnusb *x)
 {
-	if (x->dev_handle) usb_close(x->dev_handle);
-//	freeobject((t_object *)x->m_clock);  			// free the clock
-	
-	freebytes((t_object *)x->m_clock, sizeof(x->m_clock));
+	gnusb_client_detach(&x->client);				// the last one closes the device
+	clock_free(x->m_clock);
 
 }
 
 
-
-
-
 //--------------------------------------------------------------------------
-// - USB Utility Functions
+// - Scheduler side of the usb thread
 //--------------------------------------------------------------------------
 
-
-static int  usbGetStringAscii(usb_dev_handle *dev, int index, int langid, char *buf, int buflen)
+static void send_command(t_gnusb *x, int type, int request, int value, int index, unsigned char *data, int len)
 {
-char    buffer[256];
-int     rval, i;
-
-    if((rval = usb_control_msg(dev, USB_ENDPOINT_IN, USB_REQ_GET_DESCRIPTOR, (USB_DT_STRING << 8) + index, langid, buffer, sizeof(buffer), 1000)) < 0)
-        return rval;
-    if(buffer[1] != USB_DT_STRING)
-        return 0;
-    if((unsigned char)buffer[0] < rval)
-        rval = (unsigned char)buffer[0];
-    rval /= 2;
-    /* lossy conversion to ISO Latin1 */
-    for(i=1;i<rval;i++){
-        if(i > buflen)  /* destination buffer overflow */
-            break;
-        buf[i-1] = buffer[2 * i];
-        if(buffer[2 * i + 1] != 0)  /* outside of ISO Latin1 range */
-            buf[i-1] = '?';
-    }
-    buf[i-1] = 0;
-    return i-1;
+	if (!x->client.device) return;
+	if (!gnusb_client_send(&x->client, type, request, value, index, data, len))
+		error("gnusb: usb thread is busy, dropped command");
 }
 
 //--------------------------------------------------------------------------
 
-
-void find_device(t_gnusb *x)
+static void output_values(t_gnusb *x, unsigned char *buffer)
 {
-	usb_dev_handle      *handle = NULL;
-	struct usb_bus      *bus;
-	struct usb_device   *dev;
-	
-	usb_find_busses();
-    usb_find_devices();
-	 for(bus=usb_busses; bus; bus=bus->next){
-        for(dev=bus->devices; dev; dev=dev->next){
-            if(dev->descriptor.idVendor == USBDEV_SHARED_VENDOR && dev->descriptor.idProduct == USBDEV_SHARED_PRODUCT){
-                char    string[256];
-                int     len;
-                handle = usb_open(dev); /* we need to open the device in order to query strings */
-                if(!handle){
-                    error ("Warning: cannot open USB device: %s", usb_strerror());
-                    continue;
-                }
-                /* now find out whether the device actually is gnusb */
-                len = usbGetStringAscii(handle, dev->descriptor.iManufacturer, 0x0409, string, sizeof(string));
-                if(len < 0){
-                    post("gnusb: warning: cannot query manufacturer for device: %s", usb_strerror());
-                    goto skipDevice;
-                }
-                
-			//	post("gnusb: seen device from vendor ->%s<-", string); 
-                if(strcmp(string, "www.anyma.ch") != 0)
-                    goto skipDevice;
-                len = usbGetStringAscii(handle, dev->descriptor.iProduct, 0x0409, string, sizeof(string));
-                if(len < 0){
-                    post("gnusb: warning: cannot query product for device: %s", usb_strerror());
-                    goto skipDevice;
-                }
-              //  post("gnusb: seen product ->%s<-", string);
-                if(strcmp(string, "gnusb") == 0)
-                    break;
-skipDevice:
-                usb_close(handle);
-                handle = NULL;
-            }
-        }
-        if(handle)
-            break;
-    }
-	
-    if(!handle){
-        post("gnusb: Could not find USB device www.anyma.ch/gnusb");
-		x->dev_handle = NULL;
-		if (x->m_interval < 10000) x->m_interval *=2; // throttle polling down to max 20s if we can't find a gnusb
-	} else {
-		x->dev_handle = handle;
-		 post("gnusb: Found USB device www.anyma.ch/gnusb");
-		 x->m_interval = x->m_interval_bak;			// restore original polling interval
-		 if (x->is_running) gnusb_tick(x);
-		 else gnusb_bang(x);
+	int                 i,n;
+	int 				replymask,replyshift,replybyte;
+	int					temp;
+
+	for (i = 0; i < OUTLETS; i++) {
+		// n = OUTLETS - i - 1; // on max/msp outlets are reversed
+		n = i;
+		temp = buffer[n];
+
+
+												// add 2 stuffed bits from end of buffer if we're doing 10bit precision
+		if (n < 8) {
+			if (x->do_10_bit) {
+
+				if (n < 4)  replybyte = buffer[10];
+				else replybyte = buffer[11];
+
+				replyshift = ((n % 4) * 2);			// how much to shift the bits
+				replymask = (3 << replyshift);
+
+				temp = temp * 4 + ((replybyte & replymask) >> replyshift);	// add 2 LSB
+
+			}
+		}
+
+		if (x->values[i] != temp) {					// output if value has changed
+//max			outlet_int(x->outlets[i], temp);
+			outlet_float(x->outlets[i], temp);
+			x->values[i] = temp;
+		}
 	}
-}
\ No newline at end of file
+}
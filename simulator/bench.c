@@ -0,0 +1,307 @@
+// ==============================================================================
+// bench.c
+//
+// Benchmark of the host side against the simulated gnusbmatrix: opens the
+// device through common/gnusb_device.c, the same way the Max and Pd objects
+// do, presses buttons on the simulator and measures how long it takes until
+// the change comes out as a GNUSB_MSG_VALUES reply. Then taps buttons faster
+// than a 40 ms poll sees them, counts the GNUSB_MSG_BUTTONS events that make
+// it and compares their device time to the host's, and how far the moment
+// they arrive and the moment the device clock estimate puts them at scatter
+// around the press. Then times a burst of GNUSB_CMD_SET writes, checks that
+// the client stays busy until the answers to queries sent in a row are all
+// in (with -w they cancel the long poll in flight), and times a replug.
+//
+// usage: bench [-p | -w] [-n presses] [-i interval] [-l latency]
+//	-p		poll with GNUSB_CMD_POLL instead of reading the interrupt endpoint
+//	-w		long poll with GNUSB_CMD_WAIT_CHANGES instead of reading the interrupt endpoint
+//	-n		number of button presses, default 50
+//	-i		poll interval in ms, default 1
+//	-l		usb transfer latency in usec, overrides GNUSBSIM_LATENCY_US
+//
+// License:
+// The project is built with AVR USB driver by Objective Development, which is
+// published under an own licence based on the GNU General Public License (GPL).
+// gnusb is also distributed under this enhanced licence. See Documentation.
+//
+// ==============================================================================
+
+#include "gnusbsim.h"
+#include "gnusb_device.h"
+#include "gnusb_cmds.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#define TIMEOUT_MS		5000
+#define WRITES			200
+#define TAPS			20
+#define TAP_MS			30			// press and pause, longer than the debouncing
+#define TAP_INTERVAL	40			// ms, the default of the externals
+#define QUERIES			2			// GNUSB_CMD_GET_PRESETS in a row
+
+static t_gnusb_client	client;
+static unsigned char	values[8];			// what the host side has seen last
+static int				events, events_lost;	// GNUSB_MSG_BUTTONS so far
+static int				taps;					// presses among them, and the device time
+static unsigned int		first_tap, last_tap;	// of the first and the last one
+static double			tap_at[TAPS];			// host time of every press
+static double			arrived[2], estimated[2];	// min and max of how late a press was seen
+static int				answers;				// GNUSB_MSG_ANSWER so far
+
+
+//--------------------------------------------------------------------------
+
+static double now_ms(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000. + ts.tv_nsec / 1e6;
+}
+
+//--------------------------------------------------------------------------
+// what the scheduler tick does in the externals.
+// -> returns the type of the last reply, 0 if there was none
+
+static void spread(double *range, double t)
+{
+	if (t < range[0]) range[0] = t;
+	if (t > range[1]) range[1] = t;
+}
+
+static int drain_replies(void)
+{
+	t_gnusb_msg		msg;
+	int				type = 0;
+	int				i;
+
+	while (gnusb_queue_pop(&client.replies, &msg)) {
+		if (msg.type == GNUSB_MSG_VALUES) memcpy(values, msg.data, sizeof(values));
+		if (msg.type == GNUSB_MSG_BUTTONS) {
+			events += msg.len / GNUSB_MSG_EVENT_LEN;
+			events_lost += msg.value;
+			for (i = 0; i + GNUSB_MSG_EVENT_LEN <= msg.len; i += GNUSB_MSG_EVENT_LEN) {
+				if (!(msg.data[i] & GNUSB_EVENT_PRESS)) continue;
+				last_tap = msg.data[i + 1] | (msg.data[i + 2] << 8) | (msg.data[i + 3] << 16) | ((unsigned int)msg.data[i + 4] << 24);
+				if (!taps++) first_tap = last_tap;
+				if (taps > TAPS) continue;
+				spread(arrived, now_ms() - tap_at[taps - 1]);
+				spread(estimated, now_ms() - gnusb_client_event_age(msg.data + i) - tap_at[taps - 1]);
+			}
+		}
+		if (msg.type == GNUSB_MSG_ANSWER) answers++;
+		type = msg.type;
+	}
+	return type;
+}
+
+//--------------------------------------------------------------------------
+
+static int wait_for(int type)
+{
+	double	until = now_ms() + TIMEOUT_MS;
+
+	while (now_ms() < until) {
+		if (drain_replies() == type) return 1;
+		usleep(100);
+	}
+	return 0;
+}
+
+//--------------------------------------------------------------------------
+// wait until the led of a button shows up as lit or dark
+
+static double wait_for_led(int button, int lit)
+{
+	double	start = now_ms();
+	int		row = button / 8;
+	int		bit = 1 << (7 - button % 8);
+
+	while (now_ms() < start + TIMEOUT_MS) {
+		drain_replies();
+		if (((values[row] & bit) != 0) == lit) return now_ms() - start;
+		usleep(50);
+	}
+	return -1.;
+}
+
+//--------------------------------------------------------------------------
+// like the scheduler: pick up replies every ms while waiting
+
+static void pause_ms(int ms)
+{
+	double	until = now_ms() + ms;
+
+	while (now_ms() < until) {
+		drain_replies();
+		usleep(1000);
+	}
+}
+
+//--------------------------------------------------------------------------
+
+static void settle(void)
+{
+	while (gnusb_client_busy(&client)) usleep(100);
+	usleep(50000);
+	drain_replies();
+}
+
+
+// ==============================================================================
+// main
+// ------------------------------------------------------------------------------
+
+int main(int argc, char **argv)
+{
+	t_gnusbsim_stats	before, after;
+	unsigned char		modes[64], row[8];
+	double				t, t0, sum = 0., min = 1e9, max = 0.;
+	int					use_interrupt = 1;
+	int					use_wait = 0;
+	int					presses = 50;
+	int					interval = 1;
+	int					opt, i, button, lost = 0, early = 0;
+
+	while ((opt = getopt(argc, argv, "pwn:i:l:")) != -1) {
+		switch (opt) {
+			case 'p': use_interrupt = 0; use_wait = 0; break;
+			case 'w': use_interrupt = 0; use_wait = 1; break;
+			case 'n': presses = atoi(optarg); break;
+			case 'i': interval = atoi(optarg); break;
+			case 'l': gnusbsim_start(); gnusbsim_set_latency(atoi(optarg)); break;
+			default:
+				fprintf(stderr, "usage: %s [-p | -w] [-n presses] [-i interval] [-l latency]\n", argv[0]);
+				return 1;
+		}
+	}
+	if (interval < 1) interval = 1;
+
+	if (!gnusb_client_attach(&client, "gnusbmatrix", NULL, 0, 8, use_interrupt)) {
+		fprintf(stderr, "bench: could not start usb thread\n");
+		return 1;
+	}
+	gnusb_client_send(&client, GNUSB_MSG_WAIT, 0, use_wait, 0, NULL, 0);
+	gnusb_client_send(&client, GNUSB_MSG_OPEN, 0, 0, 0, NULL, 0);
+	if (!wait_for(GNUSB_MSG_FOUND)) {
+		fprintf(stderr, "bench: simulator not found\n");
+		return 1;
+	}
+
+	// all impulse: leds follow the buttons
+	memset(modes, BTN_MODE_IMPULSE, sizeof(modes));
+	gnusb_client_send(&client, GNUSB_MSG_CONTROL, GNUSB_CMD_SET_ALL_MODES, sizeof(modes), 0, modes, sizeof(modes));
+	gnusb_client_send(&client, GNUSB_MSG_CONTROL, GNUSB_CMD_CLEAR, 0, 0, NULL, 0);
+	gnusb_client_send(&client, GNUSB_MSG_INTERVAL, 0, interval, 0, NULL, 0);
+	settle();
+
+	printf("gnusbsim: %s, interval %d ms, transfer latency %d us\n",
+			use_interrupt ? "interrupt endpoint" : use_wait ? "long polling" : "polling", interval, gnusbsim_latency());
+
+	// ----------------------------------------------------- button -> host latency
+	for (i = 0; i < presses; i++) {
+		button = (i * 13) % 64;
+		gnusbsim_press(button);
+		t = wait_for_led(button, 1);
+		gnusbsim_release(button);
+		if (t < 0 || wait_for_led(button, 0) < 0) {
+			lost++;
+			continue;
+		}
+		sum += t;
+		if (t < min) min = t;
+		if (t > max) max = t;
+	}
+	if (presses > lost) {
+		printf("press -> values:  min %.2f ms  avg %.2f ms  max %.2f ms  (%d presses, %d lost)\n",
+				min, sum / (presses - lost), max, presses, lost);
+	}
+
+	// ----------------------------------------------------- taps between polls
+	gnusb_client_send(&client, GNUSB_MSG_INTERVAL, 0, TAP_INTERVAL, 0, NULL, 0);
+	gnusb_client_send(&client, GNUSB_MSG_EVENTS, 0, 1, 0, NULL, 0);
+	settle();
+	events = 0;
+	taps = 0;
+	arrived[0] = estimated[0] = 1e9;
+	arrived[1] = estimated[1] = -1e9;
+	t0 = now_ms();
+	for (i = 0; i < TAPS; i++) {
+		tap_at[i] = now_ms();
+		gnusbsim_press(i % 64);
+		pause_ms(TAP_MS);
+		gnusbsim_release(i % 64);
+		pause_ms(TAP_MS);
+	}
+	t = (now_ms() - t0) / TAPS;
+	t0 = now_ms();
+	while (events < 2 * TAPS && now_ms() < t0 + 4 * TAP_INTERVAL) {
+		drain_replies();
+		usleep(1000);
+	}
+	printf("taps -> events:   %d of %d presses and releases at a %d ms poll%s\n",
+			events, 2 * TAPS, TAP_INTERVAL, events_lost ? ", some lost" : "");
+	if (taps > 1) printf("tap period:       %.2f ms on the device clock, %.2f ms on the host\n",
+							(last_tap - first_tap) * GNUSB_TICK_MS / (taps - 1), t);
+	if (taps) printf("press -> event:   arrives %.2f to %.2f ms late, device clock says %.2f to %.2f ms\n",
+						arrived[0], arrived[1], estimated[0], estimated[1]);
+	gnusb_client_send(&client, GNUSB_MSG_EVENTS, 0, 0, 0, NULL, 0);
+	gnusb_client_send(&client, GNUSB_MSG_INTERVAL, 0, interval, 0, NULL, 0);
+
+	// ----------------------------------------------------- write throughput
+	settle();
+	gnusbsim_get_stats(&before);
+	memset(row, 0, sizeof(row));
+	t0 = now_ms();
+	for (i = 0; i < WRITES; i++) {
+		row[i % 8] ^= 0xff;
+		while (!gnusb_client_send(&client, GNUSB_MSG_CONTROL, GNUSB_CMD_SET, sizeof(row), 0, row, sizeof(row)))
+			usleep(100);								// queue full, let the device thread catch up
+	}
+	do {
+		usleep(100);
+		gnusbsim_get_stats(&after);
+	} while (after.control_out - before.control_out < WRITES && now_ms() < t0 + TIMEOUT_MS);
+	t = now_ms() - t0;
+	printf("writes:           %lu in %.1f ms, %.0f per second\n",
+			after.control_out - before.control_out, t, (after.control_out - before.control_out) * 1000. / t);
+
+	// ----------------------------------------------------- queries
+	// like a bang in the externals: keep picking up replies while busy
+	gnusb_client_send(&client, GNUSB_MSG_INTERVAL, 0, TAP_INTERVAL, 0, NULL, 0);
+	settle();
+	answers = 0;
+	for (i = 0; i < QUERIES; i++) {
+		gnusb_client_send(&client, GNUSB_MSG_QUERY, GNUSB_CMD_GET_PRESETS, 0, 0, NULL, 3);
+		usleep(500);
+	}
+	t0 = now_ms();
+	while (gnusb_client_busy(&client) && now_ms() < t0 + TIMEOUT_MS) {
+		drain_replies();
+		usleep(100);
+	}
+	drain_replies();
+	early = (answers < QUERIES);
+	printf("queries -> busy:  %d of %d answers in before the client went idle\n", answers, QUERIES);
+	gnusb_client_send(&client, GNUSB_MSG_INTERVAL, 0, interval, 0, NULL, 0);
+
+	// ----------------------------------------------------- replug
+	settle();
+	gnusbsim_plug(0);
+	wait_for(GNUSB_MSG_CLOSED);
+	t0 = now_ms();
+	gnusbsim_plug(1);
+	if (wait_for(GNUSB_MSG_FOUND)) printf("replug -> found:   %.2f ms\n", now_ms() - t0);
+	else printf("replug -> found:   not found\n");
+
+	gnusbsim_get_stats(&after);
+	printf("totals:           %lu control in (%lu bytes), %lu control out, %lu interrupt in, %lu stalls, %lu eeprom writes\n",
+			after.control_in, after.control_in_bytes, after.control_out, after.interrupt_in, after.stalls, after.eeprom_writes);
+
+	gnusb_client_detach(&client);
+	return (lost || early) ? 1 : 0;
+}
@@ -0,0 +1,294 @@
+// ==============================================================================
+// gnusbsim.c
+//
+// Simulated gnusbmatrix: runs the native build of firmware/main.c, on the
+// mocked hardware of firmware/native/hal_native.c.
+//
+// A firmware thread plays the main loop: every pass calls checkButtons() and
+// sendReport() like main() does, and once per period timer 0 overflows and
+// its interrupt scans the next row.
+// USB requests from the shim run in between passes, the way the usb interrupt
+// would cut in on the real chip. One lock around the chip keeps them apart.
+//
+// License:
+// The project is built with AVR USB driver by Objective Development, which is
+// published under an own licence based on the GNU General Public License (GPL).
+// gnusb is also distributed under this enhanced licence. See Documentation.
+//
+// ==============================================================================
+
+#include "gnusb.h"			// built with GNUSB_NATIVE: brings native/native.h
+#include "gnusbsim.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#define DEFAULT_LATENCY_US		1000
+#define DEFAULT_TICK_US			1365	// 12MHz, prescaler 64, 256 counts
+#define PASS_US					100		// time between two passes of the main loop
+
+static unsigned char	leds[8];					// last thing each row showed
+
+// ------------------------------------------------------------------------------
+// the simulator
+static pthread_mutex_t	chip_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t		firmware_thread;
+static int				started = 0;
+static int				plugged = 1;
+static unsigned			generation = 0;
+static int				latency_us = DEFAULT_LATENCY_US;
+static int				tick_us = DEFAULT_TICK_US;
+static t_gnusbsim_stats	stats;
+
+
+// ==============================================================================
+// The main loop
+// ------------------------------------------------------------------------------
+
+static double now_us(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+//--------------------------------------------------------------------------
+
+static void reset_chip(void)
+{
+	hal_row = 0;
+	hal_leds = 0;
+	hal_timer_running = 1;
+	usbTxLen1 = USBPID_NAK;
+	initState();
+}
+
+//--------------------------------------------------------------------------
+
+static void *firmware_main(void *arg)
+{
+	struct timespec	pause;
+	double			next_tick = now_us();
+	pause.tv_sec = 0;
+	pause.tv_nsec = PASS_US * 1000;
+
+	while (1) {
+		pthread_mutex_lock(&chip_lock);
+		if (plugged) {
+			if (now_us() >= next_tick) {
+				next_tick += tick_us;
+				if (hal_timer_running) {
+					TIMER0_OVF_vect();
+					leds[hal_row & 7] = hal_leds;
+					stats.scans++;
+				}
+			}
+			checkButtons();
+			sendReport();
+			eepromPoll();
+		} else {
+			next_tick = now_us();
+		}
+		pthread_mutex_unlock(&chip_lock);
+		nanosleep(&pause, NULL);
+	}
+	return NULL;
+}
+
+//--------------------------------------------------------------------------
+
+void gnusbsim_start(void)
+{
+	char	*env;
+
+	pthread_mutex_lock(&chip_lock);
+	if (!started) {
+		started = 1;
+		if ((env = getenv("GNUSBSIM_LATENCY_US"))) latency_us = atoi(env);
+		if ((env = getenv("GNUSBSIM_TICK_US"))) tick_us = atoi(env);
+		if (tick_us < 1) tick_us = DEFAULT_TICK_US;
+
+		memset(hal_eeprom, 0xff, sizeof(hal_eeprom));	// erased, like a fresh chip
+		reset_chip();
+		pthread_create(&firmware_thread, NULL, firmware_main, NULL);
+	}
+	pthread_mutex_unlock(&chip_lock);
+}
+
+
+// ==============================================================================
+// Scripting
+// ------------------------------------------------------------------------------
+
+void gnusbsim_press(int button)
+{
+	pthread_mutex_lock(&chip_lock);
+	hal_switches[(button / 8) & 7] |= (1 << (button % 8));
+	pthread_mutex_unlock(&chip_lock);
+}
+
+void gnusbsim_release(int button)
+{
+	pthread_mutex_lock(&chip_lock);
+	hal_switches[(button / 8) & 7] &= ~(1 << (button % 8));
+	pthread_mutex_unlock(&chip_lock);
+}
+
+void gnusbsim_plug(int p)
+{
+	pthread_mutex_lock(&chip_lock);
+	if (p && !plugged) {
+		reset_chip();								// comes up from a power cycle
+		generation++;
+	}
+	plugged = p;
+	pthread_mutex_unlock(&chip_lock);
+}
+
+void gnusbsim_set_latency(int usec)
+{
+	latency_us = usec;
+}
+
+void gnusbsim_get_stats(t_gnusbsim_stats *s)
+{
+	pthread_mutex_lock(&chip_lock);
+	*s = stats;
+	s->eeprom_writes = hal_eeprom_writes;
+	pthread_mutex_unlock(&chip_lock);
+}
+
+void gnusbsim_get_leds(unsigned char *l)
+{
+	pthread_mutex_lock(&chip_lock);
+	memcpy(l, leds, sizeof(leds));
+	pthread_mutex_unlock(&chip_lock);
+}
+
+
+// ==============================================================================
+// USB
+// ------------------------------------------------------------------------------
+
+int gnusbsim_plugged(void)				{ return plugged; }
+int gnusbsim_latency(void)				{ return latency_us; }
+int gnusbsim_interrupt_interval(void)	{ return USB_CFG_INTR_POLL_INTERVAL; }
+unsigned gnusbsim_generation(void)		{ return generation; }
+
+//--------------------------------------------------------------------------
+// a reply usbFunctionRead() makes up, 8 bytes at a time like the driver asks.
+// chip_lock held
+
+static int read_reply(unsigned char *data, int len)
+{
+	int				n, done;
+
+	if (usbFunctionReadWait()) return GNUSBSIM_NAK;
+	for (done = 0; done < len; done += n) {
+		n = usbFunctionRead(data + done, (len - done < 8) ? len - done : 8);
+		if (n < 8) return done + n;					// a short packet ends it
+	}
+	return done;
+}
+
+//--------------------------------------------------------------------------
+// what the driver does with a SETUP packet and its data stage
+
+int gnusbsim_control(unsigned char *setup, unsigned char *data, int len)
+{
+	unsigned char	chunk[8];
+	uchar			reply;
+	int				n, done;
+
+	pthread_mutex_lock(&chip_lock);
+	memcpy(chunk, setup, 8);
+	usbMsgPtr = NULL;
+	reply = usbFunctionSetup(chunk);
+
+	if (setup[0] & 0x80) {							// device to host
+		stats.control_in++;
+		n = (reply < len) ? reply : len;
+		if (reply == 0xff) n = read_reply(data, len);
+		else if (n && usbMsgPtr) memcpy(data, usbMsgPtr, n);
+		else n = 0;
+		if (n > 0) stats.control_in_bytes += n;
+	} else {										// host to device
+		stats.control_out++;
+		n = 0;
+		if (reply == 0xff) {						// the firmware wants the data
+			for (done = 0; done < len; done += 8) {
+				memcpy(chunk, data + done, (len - done < 8) ? len - done : 8);
+				reply = usbFunctionWrite(chunk, (len - done < 8) ? len - done : 8);
+				if (reply) break;
+			}
+			if (reply == 0xff) n = -1;
+		}
+	}
+	if (n == -1) stats.stalls++;
+	pthread_mutex_unlock(&chip_lock);
+	return n;
+}
+
+int gnusbsim_control_data(unsigned char *data, int len)
+{
+	int				n;
+
+	pthread_mutex_lock(&chip_lock);
+	n = read_reply(data, len);
+	if (n > 0) stats.control_in_bytes += n;
+	pthread_mutex_unlock(&chip_lock);
+	return n;
+}
+
+//--------------------------------------------------------------------------
+
+int gnusbsim_interrupt(unsigned char *data, int len)
+{
+	int		n = -1;
+
+	pthread_mutex_lock(&chip_lock);
+	if (!usbInterruptIsReady()) {					// there is a report waiting
+		n = (hal_report_len < len) ? hal_report_len : len;
+		memcpy(data, hal_report, n);
+		usbTxLen1 = USBPID_NAK;
+		stats.interrupt_in++;
+	}
+	pthread_mutex_unlock(&chip_lock);
+	return n;
+}
+
+//--------------------------------------------------------------------------
+
+int gnusbsim_string(int index, char *buf, int len)
+{
+	static const char	vendor[] = { USB_CFG_VENDOR_NAME, 0 };
+	static const char	product[] = { USB_CFG_DEVICE_NAME, 0 };
+	usbRequest_t		rq;
+	int					*descriptor;
+	int					i, n;
+
+	if (len < 1) return -1;
+	if (index == 1) {
+		strncpy(buf, vendor, len);
+	} else if (index == 2) {
+		strncpy(buf, product, len);
+	} else if (index == 3) {						// the firmware builds this one
+		memset(&rq, 0, sizeof(rq));
+		pthread_mutex_lock(&chip_lock);
+		n = usbFunctionDescriptor(&rq);
+		descriptor = (int *)usbMsgPtr;
+		n = (n - 2) / 2;							// header, then 16bit chars
+		for (i = 0; i < n && i < len - 1; i++) {
+			buf[i] = descriptor[1 + i];
+		}
+		buf[i] = 0;
+		pthread_mutex_unlock(&chip_lock);
+	} else {
+		return -1;
+	}
+	buf[len - 1] = 0;
+	return strlen(buf);
+}
@@ -0,0 +1,74 @@
+// ==============================================================================
+// gnusbsim.h
+//
+// Simulated gnusbmatrix for benchmarking and testing the host software
+// without hardware. The real firmware/main.c runs natively on the mocked
+// hardware of firmware/native: switch matrix, leds and EEPROM. libusb.h in
+// this directory is a libusb-1.0 shim that talks to it, so the host code
+// builds unmodified.
+//
+// Environment:
+//	GNUSBSIM_LATENCY_US		time every usb transfer takes, default 1000
+//	GNUSBSIM_TICK_US		timer0 overflow period, default 1365 (12MHz / 64 / 256)
+//
+// License:
+// The project is built with AVR USB driver by Objective Development, which is
+// published under an own licence based on the GNU General Public License (GPL).
+// gnusb is also distributed under this enhanced licence. See Documentation.
+//
+// ==============================================================================
+
+#ifndef __gnusbsim_h_included__
+#define __gnusbsim_h_included__
+
+#define GNUSBSIM_STRING_LEN			64
+#define GNUSBSIM_NAK				-2		// the firmware holds back the data stage, ask again
+
+typedef struct _gnusbsim_stats
+{
+	unsigned long	control_in;			// transfers executed by the firmware
+	unsigned long	control_in_bytes;	// what they read
+	unsigned long	control_out;
+	unsigned long	interrupt_in;		// reports picked up from the interrupt endpoint
+	unsigned long	stalls;
+	unsigned long	eeprom_writes;
+	unsigned long	scans;				// passes of the main loop that saw a timer overflow
+} t_gnusbsim_stats;
+
+// ------------------------------------------------------------------------------
+// - start the firmware thread, called by the shim. safe to call more than once
+// ------------------------------------------------------------------------------
+extern void		gnusbsim_start			(void);
+
+// ------------------------------------------------------------------------------
+// - scripting
+// ------------------------------------------------------------------------------
+extern void		gnusbsim_press			(int button);		// 0..63, 8 * row + column
+extern void		gnusbsim_release		(int button);
+extern void		gnusbsim_plug			(int plugged);		// hotplug, replugging resets the firmware
+extern void		gnusbsim_set_latency	(int usec);
+extern void		gnusbsim_get_stats		(t_gnusbsim_stats *stats);
+extern void		gnusbsim_get_leds		(unsigned char *leds);	// what the firmware shows, 8 rows
+
+// ------------------------------------------------------------------------------
+// - used by the shim. all of them lock the simulated chip while they run
+// ------------------------------------------------------------------------------
+extern int		gnusbsim_plugged		(void);
+extern int		gnusbsim_latency		(void);				// usec per transfer
+extern int		gnusbsim_interrupt_interval(void);			// ms between interrupt polls
+extern unsigned	gnusbsim_generation		(void);				// counts replugs
+
+// run a control transfer: setup is the 8 byte setup packet, data the data stage.
+// returns the number of bytes in data for IN transfers, or -1 for a stall.
+// GNUSBSIM_NAK if the firmware waits before it answers: gnusbsim_control_data()
+// asks again, any other transfer on endpoint 0 has to wait until it's done
+extern int		gnusbsim_control		(unsigned char *setup, unsigned char *data, int len);
+extern int		gnusbsim_control_data	(unsigned char *data, int len);
+
+// pick up a pending interrupt report, returns -1 if there is none (NAK)
+extern int		gnusbsim_interrupt		(unsigned char *data, int len);
+
+// string descriptor as ascii, index 1 vendor, 2 product, 3 serial. -1 if there is none
+extern int		gnusbsim_string			(int index, char *buf, int len);
+
+#endif /* __gnusbsim_h_included__ */
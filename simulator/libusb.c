@@ -0,0 +1,510 @@
+// ==============================================================================
+// libusb.c
+//
+// libusb-1.0 shim for the simulator, see libusb.h
+//
+// Every context keeps its own list of transfers in flight, each with the time
+// it is due back. libusb_get_next_timeout() tells the caller when the next one
+// is, and libusb_handle_events_timeout() runs the due ones against gnusbsim
+// and calls their callbacks, just like libusb would. A pipe stands in for
+// the usbfs descriptors, so poll() returns when something needs handling
+// right away (cancellations).
+//
+// License:
+// The project is built with AVR USB driver by Objective Development, which is
+// published under an own licence based on the GNU General Public License (GPL).
+// gnusb is also distributed under this enhanced licence. See Documentation.
+//
+// ==============================================================================
+
+#include "libusb.h"
+#include "gnusbsim.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <time.h>
+
+#define SIM_VENDOR_ID			0x16c0		// obdev's shared vid/pid, like usbconfig.h
+#define SIM_PRODUCT_ID			0x05dc
+#define SIM_BUS					1
+#define SIM_PORT				1
+#define HOTPLUG_CHECK_MS		10			// how fast the "kernel" notices a replug
+#define NAK_RETRY_MS			0.1			// the host controller asks again that soon after a NAK
+
+struct libusb_device
+{
+	libusb_context			*ctx;
+};
+
+struct libusb_device_handle
+{
+	libusb_context			*ctx;
+	unsigned				generation;		// the plug-in this handle belongs to
+};
+
+typedef struct _sim_transfer
+{
+	struct libusb_transfer	pub;			// first, so the two pointers convert
+	struct _sim_transfer	*next;
+	double					due;			// ms, when the device gets to see it
+	double					deadline;		// ms, 0 -> no timeout
+	int						cancelled;
+	int						submitted;
+} t_sim_transfer;
+
+struct libusb_context
+{
+	int						pipe[2];
+	struct libusb_pollfd	pollfd;
+	const struct libusb_pollfd *pollfds[2];
+	t_sim_transfer			*transfers;		// in flight
+	double					control_free;	// ms, control transfers share endpoint 0 and go one by one
+	struct _sim_transfer	*control_nak;	// the one the device NAKs, the others wait for it
+	libusb_hotplug_callback_fn hotplug_fn;
+	void					*hotplug_data;
+	int						seen_plugged;	// what hotplug has told the owner so far
+	unsigned				seen_generation;
+	struct libusb_device	device;			// the one on the simulated bus
+};
+
+
+// ==============================================================================
+// Time
+// ------------------------------------------------------------------------------
+
+static double now_ms(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000. + ts.tv_nsec / 1e6;
+}
+
+//--------------------------------------------------------------------------
+
+static int handle_alive(libusb_device_handle *h)
+{
+	return gnusbsim_plugged() && h->generation == gnusbsim_generation();
+}
+
+
+// ==============================================================================
+// Setup and devices
+// ------------------------------------------------------------------------------
+
+int libusb_init(libusb_context **ctx)
+{
+	libusb_context	*c;
+
+	c = (libusb_context *)calloc(1, sizeof(libusb_context));
+	if (!c) return LIBUSB_ERROR_NO_MEM;
+	if (pipe(c->pipe) != 0) {
+		free(c);
+		return LIBUSB_ERROR_OTHER;
+	}
+	fcntl(c->pipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(c->pipe[1], F_SETFL, O_NONBLOCK);
+	c->pollfd.fd = c->pipe[0];
+	c->pollfd.events = POLLIN;
+	c->pollfds[0] = &c->pollfd;
+	c->pollfds[1] = NULL;
+	c->device.ctx = c;
+
+	gnusbsim_start();
+	c->seen_plugged = gnusbsim_plugged();
+	c->seen_generation = gnusbsim_generation();
+	*ctx = c;
+	return LIBUSB_SUCCESS;
+}
+
+//--------------------------------------------------------------------------
+
+void libusb_exit(libusb_context *ctx)
+{
+	t_sim_transfer	*tr;
+
+	if (!ctx) return;
+	while ((tr = ctx->transfers)) {				// not handled anymore, nobody gets called back
+		ctx->transfers = tr->next;
+		tr->submitted = 0;
+	}
+	close(ctx->pipe[0]);
+	close(ctx->pipe[1]);
+	free(ctx);
+}
+
+//--------------------------------------------------------------------------
+
+int libusb_has_capability(uint32_t capability)
+{
+	return (capability == LIBUSB_CAP_HAS_CAPABILITY || capability == LIBUSB_CAP_HAS_HOTPLUG);
+}
+
+//--------------------------------------------------------------------------
+
+ssize_t libusb_get_device_list(libusb_context *ctx, libusb_device ***list)
+{
+	ssize_t		n = 0;
+
+	*list = (libusb_device **)calloc(2, sizeof(libusb_device *));
+	if (!*list) return LIBUSB_ERROR_NO_MEM;
+	if (gnusbsim_plugged()) (*list)[n++] = &ctx->device;
+	return n;
+}
+
+void libusb_free_device_list(libusb_device **list, int unref_devices)
+{
+	free(list);
+}
+
+//--------------------------------------------------------------------------
+
+int libusb_get_device_descriptor(libusb_device *dev, struct libusb_device_descriptor *desc)
+{
+	memset(desc, 0, sizeof(*desc));
+	desc->bLength = 18;
+	desc->bDescriptorType = 1;
+	desc->bcdUSB = 0x0110;
+	desc->bMaxPacketSize0 = 8;
+	desc->idVendor = SIM_VENDOR_ID;
+	desc->idProduct = SIM_PRODUCT_ID;
+	desc->iManufacturer = 1;
+	desc->iProduct = 2;
+	desc->iSerialNumber = 3;
+	desc->bNumConfigurations = 1;
+	return LIBUSB_SUCCESS;
+}
+
+uint8_t libusb_get_bus_number(libusb_device *dev)
+{
+	return SIM_BUS;
+}
+
+uint8_t libusb_get_device_address(libusb_device *dev)
+{
+	return 2 + gnusbsim_generation() % 125;		// a new one after every replug
+}
+
+int libusb_get_port_numbers(libusb_device *dev, uint8_t *port_numbers, int port_numbers_len)
+{
+	if (port_numbers_len < 1) return LIBUSB_ERROR_OVERFLOW;
+	port_numbers[0] = SIM_PORT;
+	return 1;
+}
+
+
+// ==============================================================================
+// Handles
+// ------------------------------------------------------------------------------
+
+int libusb_open(libusb_device *dev, libusb_device_handle **dev_handle)
+{
+	libusb_device_handle	*h;
+
+	if (!gnusbsim_plugged()) return LIBUSB_ERROR_NO_DEVICE;
+	h = (libusb_device_handle *)calloc(1, sizeof(libusb_device_handle));
+	if (!h) return LIBUSB_ERROR_NO_MEM;
+	h->ctx = dev->ctx;
+	h->generation = gnusbsim_generation();
+	*dev_handle = h;
+	return LIBUSB_SUCCESS;
+}
+
+void libusb_close(libusb_device_handle *dev_handle)
+{
+	free(dev_handle);
+}
+
+libusb_device *libusb_get_device(libusb_device_handle *dev_handle)
+{
+	return &dev_handle->ctx->device;
+}
+
+int libusb_claim_interface(libusb_device_handle *dev_handle, int interface_number)
+{
+	if (!handle_alive(dev_handle)) return LIBUSB_ERROR_NO_DEVICE;
+	return (interface_number == 0) ? LIBUSB_SUCCESS : LIBUSB_ERROR_NOT_FOUND;
+}
+
+int libusb_release_interface(libusb_device_handle *dev_handle, int interface_number)
+{
+	if (!handle_alive(dev_handle)) return LIBUSB_ERROR_NO_DEVICE;
+	return LIBUSB_SUCCESS;
+}
+
+//--------------------------------------------------------------------------
+// synchronous, so it blocks for a whole transfer
+
+int libusb_get_string_descriptor_ascii(libusb_device_handle *dev_handle, uint8_t desc_index,
+										unsigned char *data, int length)
+{
+	struct timespec	ts;
+	int				us = gnusbsim_latency();
+
+	ts.tv_sec = us / 1000000;
+	ts.tv_nsec = (us % 1000000) * 1000;
+	nanosleep(&ts, NULL);
+
+	if (!handle_alive(dev_handle)) return LIBUSB_ERROR_NO_DEVICE;
+	if (gnusbsim_string(desc_index, (char *)data, length) < 0) return LIBUSB_ERROR_PIPE;
+	return strlen((char *)data);
+}
+
+
+// ==============================================================================
+// Transfers
+// ------------------------------------------------------------------------------
+
+struct libusb_transfer *libusb_alloc_transfer(int iso_packets)
+{
+	return (struct libusb_transfer *)calloc(1, sizeof(t_sim_transfer));
+}
+
+void libusb_free_transfer(struct libusb_transfer *transfer)
+{
+	free(transfer);
+}
+
+//--------------------------------------------------------------------------
+
+int libusb_submit_transfer(struct libusb_transfer *transfer)
+{
+	t_sim_transfer	*tr = (t_sim_transfer *)transfer;
+	libusb_context	*ctx = transfer->dev_handle->ctx;
+	double			now = now_ms();
+
+	if (tr->submitted) return LIBUSB_ERROR_BUSY;
+	if (!handle_alive(transfer->dev_handle)) return LIBUSB_ERROR_NO_DEVICE;
+	if (transfer->type != LIBUSB_TRANSFER_TYPE_CONTROL && transfer->type != LIBUSB_TRANSFER_TYPE_INTERRUPT)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	tr->due = now + gnusbsim_latency() / 1000.;
+	if (transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL) {
+		if (ctx->control_free > now) tr->due = ctx->control_free + gnusbsim_latency() / 1000.;
+		ctx->control_free = tr->due;
+	}
+	tr->deadline = transfer->timeout ? now + transfer->timeout : 0.;
+	tr->cancelled = 0;
+	tr->submitted = 1;
+	transfer->actual_length = 0;
+
+	tr->next = ctx->transfers;
+	ctx->transfers = tr;
+	return LIBUSB_SUCCESS;
+}
+
+//--------------------------------------------------------------------------
+
+int libusb_cancel_transfer(struct libusb_transfer *transfer)
+{
+	t_sim_transfer	*tr = (t_sim_transfer *)transfer;
+	char			c = 0;
+
+	if (!tr->submitted || tr->cancelled) return LIBUSB_ERROR_NOT_FOUND;
+	tr->cancelled = 1;
+	tr->due = 0.;
+	(void)write(transfer->dev_handle->ctx->pipe[1], &c, 1);
+	return LIBUSB_SUCCESS;
+}
+
+//--------------------------------------------------------------------------
+// what the device does with a transfer once it is due.
+// -> returns 0 if it has to wait: an interrupt read for the next poll, a
+// control transfer while the device NAKs it or one before it
+
+static int run_transfer(t_sim_transfer *tr, double now)
+{
+	struct libusb_transfer	*x = &tr->pub;
+	libusb_context			*ctx = x->dev_handle->ctx;
+	int						n;
+
+	if (ctx->control_nak == tr && (tr->cancelled || !handle_alive(x->dev_handle) || (tr->deadline && tr->deadline < tr->due)))
+		ctx->control_nak = NULL;					// given up on, the next setup ends it
+	if (tr->cancelled) {
+		x->status = LIBUSB_TRANSFER_CANCELLED;
+	} else if (!handle_alive(x->dev_handle)) {
+		x->status = LIBUSB_TRANSFER_NO_DEVICE;
+	} else if (tr->deadline && tr->deadline < tr->due) {
+		x->status = LIBUSB_TRANSFER_TIMED_OUT;
+	} else if (x->type == LIBUSB_TRANSFER_TYPE_CONTROL) {
+		if (ctx->control_nak && ctx->control_nak != tr) {
+			tr->due = now + NAK_RETRY_MS;
+			return 0;
+		}
+		if (ctx->control_nak == tr) n = gnusbsim_control_data(x->buffer + LIBUSB_CONTROL_SETUP_SIZE, x->length - LIBUSB_CONTROL_SETUP_SIZE);
+		else n = gnusbsim_control(x->buffer, x->buffer + LIBUSB_CONTROL_SETUP_SIZE, x->length - LIBUSB_CONTROL_SETUP_SIZE);
+		if (n == GNUSBSIM_NAK) {
+			ctx->control_nak = tr;
+			tr->due = now + NAK_RETRY_MS;
+			return 0;
+		}
+		ctx->control_nak = NULL;
+		if (n < 0) {
+			x->status = LIBUSB_TRANSFER_STALL;
+		} else {
+			x->status = LIBUSB_TRANSFER_COMPLETED;
+			x->actual_length = (x->buffer[0] & LIBUSB_ENDPOINT_IN) ? n : x->length - LIBUSB_CONTROL_SETUP_SIZE;
+		}
+	} else {
+		n = gnusbsim_interrupt(x->buffer, x->length);
+		if (n < 0) {									// NAK: the host asks again next interval
+			tr->due += gnusbsim_interrupt_interval();
+			if (tr->due < now) tr->due = now + gnusbsim_interrupt_interval();
+			return 0;
+		}
+		x->status = LIBUSB_TRANSFER_COMPLETED;
+		x->actual_length = n;
+	}
+	return 1;
+}
+
+//--------------------------------------------------------------------------
+// -> ms until the next transfer is due, -1 if there is none
+
+static double next_due(libusb_context *ctx, double now)
+{
+	t_sim_transfer	*tr;
+	double			due = -1.;
+	double			t;
+
+	for (tr = ctx->transfers; tr; tr = tr->next) {
+		t = tr->due;
+		if (tr->deadline && tr->deadline < t) t = tr->deadline;
+		if (due < 0 || t < due) due = t;
+	}
+	if (ctx->hotplug_fn && (due < 0 || due > now + HOTPLUG_CHECK_MS)) due = now + HOTPLUG_CHECK_MS;
+	if (due < 0) return -1.;
+	return (due > now) ? due - now : 0.;
+}
+
+//--------------------------------------------------------------------------
+
+int libusb_get_next_timeout(libusb_context *ctx, struct timeval *tv)
+{
+	double	ms = next_due(ctx, now_ms());
+
+	if (ms < 0) return 0;
+	tv->tv_sec = (long)ms / 1000;
+	tv->tv_usec = (long)((ms - tv->tv_sec * 1000.) * 1000.);
+	return 1;
+}
+
+//--------------------------------------------------------------------------
+
+const struct libusb_pollfd **libusb_get_pollfds(libusb_context *ctx)
+{
+	return ctx->pollfds;
+}
+
+void libusb_free_pollfds(const struct libusb_pollfd **pollfds)
+{
+	// they belong to the context
+}
+
+
+// ==============================================================================
+// Events
+// ------------------------------------------------------------------------------
+
+static void check_hotplug(libusb_context *ctx)
+{
+	int			plugged = gnusbsim_plugged();
+	unsigned	generation = gnusbsim_generation();
+
+	if (!ctx->hotplug_fn) return;
+	if (ctx->seen_plugged && (!plugged || generation != ctx->seen_generation)) {
+		ctx->seen_plugged = 0;
+		ctx->hotplug_fn(ctx, &ctx->device, LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT, ctx->hotplug_data);
+	}
+	if (!ctx->seen_plugged && plugged) {
+		ctx->seen_plugged = 1;
+		ctx->seen_generation = generation;
+		ctx->hotplug_fn(ctx, &ctx->device, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, ctx->hotplug_data);
+	}
+}
+
+//--------------------------------------------------------------------------
+// completes the transfer that has been due the longest. -> returns 0 if there was none
+
+static int complete_one(libusb_context *ctx)
+{
+	t_sim_transfer	**tp, **first, *tr;
+	double			now = now_ms();
+	double			when, first_when = 0.;
+
+	do {
+		first = NULL;
+		for (tp = &ctx->transfers; (tr = *tp); tp = &tr->next) {
+			when = tr->cancelled ? 0. : tr->due;
+			if (tr->deadline && tr->deadline < when) when = tr->deadline;
+			if (when <= now && (!first || when < first_when)) {
+				first = tp;
+				first_when = when;
+			}
+		}
+		if (!first) return 0;
+	} while (!run_transfer(*first, now));					// an interrupt read got NAKed, it's due later now
+
+	tr = *first;
+	*first = tr->next;
+	tr->submitted = 0;
+	tr->pub.callback(&tr->pub);							// may submit or free transfers
+	return 1;
+}
+
+//--------------------------------------------------------------------------
+
+int libusb_handle_events_timeout(libusb_context *ctx, struct timeval *tv)
+{
+	double			until = now_ms() + tv->tv_sec * 1000. + tv->tv_usec / 1000.;
+	double			now, wait;
+	struct timespec	ts;
+	char			buf[16];
+	int				handled = 0;
+
+	while (1) {
+		while (read(ctx->pipe[0], buf, sizeof(buf)) > 0);
+		check_hotplug(ctx);
+		while (complete_one(ctx)) handled = 1;
+
+		now = now_ms();
+		if (handled || now >= until) break;
+		wait = next_due(ctx, now);
+		if (wait < 0 || now + wait > until) wait = until - now;
+		ts.tv_sec = (time_t)(wait / 1000.);
+		ts.tv_nsec = (long)((wait - ts.tv_sec * 1000.) * 1e6);
+		nanosleep(&ts, NULL);
+	}
+	return LIBUSB_SUCCESS;
+}
+
+
+// ==============================================================================
+// Hotplug
+// ------------------------------------------------------------------------------
+
+int libusb_hotplug_register_callback(libusb_context *ctx, int events, int flags,
+										int vendor_id, int product_id, int dev_class,
+										libusb_hotplug_callback_fn cb_fn, void *user_data,
+										libusb_hotplug_callback_handle *callback_handle)
+{
+	if (ctx->hotplug_fn) return LIBUSB_ERROR_NO_MEM;	// one per context is all we need
+	if ((vendor_id != LIBUSB_HOTPLUG_MATCH_ANY && vendor_id != SIM_VENDOR_ID)
+		|| (product_id != LIBUSB_HOTPLUG_MATCH_ANY && product_id != SIM_PRODUCT_ID))
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	ctx->hotplug_fn = cb_fn;
+	ctx->hotplug_data = user_data;
+	ctx->seen_plugged = gnusbsim_plugged();
+	ctx->seen_generation = gnusbsim_generation();
+	*callback_handle = 1;
+	return LIBUSB_SUCCESS;
+}
+
+void libusb_hotplug_deregister_callback(libusb_context *ctx, libusb_hotplug_callback_handle callback_handle)
+{
+	ctx->hotplug_fn = NULL;
+}
@@ -0,0 +1,237 @@
+// ==============================================================================
+// libusb.h
+//
+// libusb-1.0 shim for the simulator: the part of the libusb api that
+// common/gnusb_transport.c uses, served by the simulated gnusbmatrix in
+// gnusbsim.c instead of a real bus. Put this directory first on the include
+// path and link against libgnusbsim.a instead of -lusb-1.0, and the host code
+// builds unmodified. Names, numbers and semantics follow libusb 1.0.
+//
+// There is exactly one device on the simulated bus. It shows up in
+// libusb_get_device_list() while it is plugged in and gets a new address every
+// time it is replugged. Transfers take GNUSBSIM_LATENCY_US to come back, and
+// interrupt reads are retried every USB_CFG_INTR_POLL_INTERVAL ms until the
+// firmware has a report for them. A control read the firmware holds back
+// (see usbFunctionReadWait()) is retried until it answers, and the control
+// transfers behind it wait, like on endpoint 0 of a real bus.
+//
+// License:
+// The project is built with AVR USB driver by Objective Development, which is
+// published under an own licence based on the GNU General Public License (GPL).
+// gnusb is also distributed under this enhanced licence. See Documentation.
+//
+// ==============================================================================
+
+#ifndef __gnusbsim_libusb_h_included__
+#define __gnusbsim_libusb_h_included__
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/time.h>
+
+#define LIBUSB_CONTROL_SETUP_SIZE		8
+#define LIBUSB_HOTPLUG_MATCH_ANY		-1
+
+enum libusb_error {
+	LIBUSB_SUCCESS = 0,
+	LIBUSB_ERROR_IO = -1,
+	LIBUSB_ERROR_INVALID_PARAM = -2,
+	LIBUSB_ERROR_ACCESS = -3,
+	LIBUSB_ERROR_NO_DEVICE = -4,
+	LIBUSB_ERROR_NOT_FOUND = -5,
+	LIBUSB_ERROR_BUSY = -6,
+	LIBUSB_ERROR_TIMEOUT = -7,
+	LIBUSB_ERROR_OVERFLOW = -8,
+	LIBUSB_ERROR_PIPE = -9,
+	LIBUSB_ERROR_INTERRUPTED = -10,
+	LIBUSB_ERROR_NO_MEM = -11,
+	LIBUSB_ERROR_NOT_SUPPORTED = -12,
+	LIBUSB_ERROR_OTHER = -99
+};
+
+enum libusb_transfer_status {
+	LIBUSB_TRANSFER_COMPLETED,
+	LIBUSB_TRANSFER_ERROR,
+	LIBUSB_TRANSFER_TIMED_OUT,
+	LIBUSB_TRANSFER_CANCELLED,
+	LIBUSB_TRANSFER_STALL,
+	LIBUSB_TRANSFER_NO_DEVICE,
+	LIBUSB_TRANSFER_OVERFLOW
+};
+
+enum libusb_transfer_type {
+	LIBUSB_TRANSFER_TYPE_CONTROL = 0,
+	LIBUSB_TRANSFER_TYPE_ISOCHRONOUS = 1,
+	LIBUSB_TRANSFER_TYPE_BULK = 2,
+	LIBUSB_TRANSFER_TYPE_INTERRUPT = 3
+};
+
+enum libusb_endpoint_direction {
+	LIBUSB_ENDPOINT_OUT = 0x00,
+	LIBUSB_ENDPOINT_IN = 0x80
+};
+
+enum libusb_request_type {
+	LIBUSB_REQUEST_TYPE_STANDARD = (0x00 << 5),
+	LIBUSB_REQUEST_TYPE_CLASS = (0x01 << 5),
+	LIBUSB_REQUEST_TYPE_VENDOR = (0x02 << 5),
+	LIBUSB_REQUEST_TYPE_RESERVED = (0x03 << 5)
+};
+
+enum libusb_request_recipient {
+	LIBUSB_RECIPIENT_DEVICE = 0x00,
+	LIBUSB_RECIPIENT_INTERFACE = 0x01,
+	LIBUSB_RECIPIENT_ENDPOINT = 0x02,
+	LIBUSB_RECIPIENT_OTHER = 0x03
+};
+
+enum libusb_capability {
+	LIBUSB_CAP_HAS_CAPABILITY = 0x0000,
+	LIBUSB_CAP_HAS_HOTPLUG = 0x0001
+};
+
+typedef enum {
+	LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED = 0x01,
+	LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT = 0x02
+} libusb_hotplug_event;
+
+typedef struct libusb_context libusb_context;
+typedef struct libusb_device libusb_device;
+typedef struct libusb_device_handle libusb_device_handle;
+typedef int libusb_hotplug_callback_handle;
+
+struct libusb_device_descriptor {
+	uint8_t		bLength;
+	uint8_t		bDescriptorType;
+	uint16_t	bcdUSB;
+	uint8_t		bDeviceClass;
+	uint8_t		bDeviceSubClass;
+	uint8_t		bDeviceProtocol;
+	uint8_t		bMaxPacketSize0;
+	uint16_t	idVendor;
+	uint16_t	idProduct;
+	uint16_t	bcdDevice;
+	uint8_t		iManufacturer;
+	uint8_t		iProduct;
+	uint8_t		iSerialNumber;
+	uint8_t		bNumConfigurations;
+};
+
+struct libusb_pollfd {
+	int			fd;
+	short		events;
+};
+
+struct libusb_transfer;
+typedef void (*libusb_transfer_cb_fn)(struct libusb_transfer *transfer);
+
+struct libusb_transfer {
+	libusb_device_handle	*dev_handle;
+	uint8_t					flags;
+	unsigned char			endpoint;
+	unsigned char			type;
+	unsigned int			timeout;
+	enum libusb_transfer_status status;
+	int						length;
+	int						actual_length;
+	libusb_transfer_cb_fn	callback;
+	void					*user_data;
+	unsigned char			*buffer;
+	int						num_iso_packets;
+};
+
+typedef int (*libusb_hotplug_callback_fn)(libusb_context *ctx, libusb_device *device,
+											libusb_hotplug_event event, void *user_data);
+
+
+// ------------------------------------------------------------------------------
+// - helpers, inline in libusb as well
+// ------------------------------------------------------------------------------
+
+static inline void libusb_fill_control_setup(unsigned char *buffer, uint8_t bmRequestType, uint8_t bRequest,
+											uint16_t wValue, uint16_t wIndex, uint16_t wLength)
+{
+	buffer[0] = bmRequestType;
+	buffer[1] = bRequest;
+	buffer[2] = wValue & 0xff;
+	buffer[3] = wValue >> 8;
+	buffer[4] = wIndex & 0xff;
+	buffer[5] = wIndex >> 8;
+	buffer[6] = wLength & 0xff;
+	buffer[7] = wLength >> 8;
+}
+
+static inline void libusb_fill_control_transfer(struct libusb_transfer *transfer, libusb_device_handle *dev_handle,
+											unsigned char *buffer, libusb_transfer_cb_fn callback, void *user_data,
+											unsigned int timeout)
+{
+	transfer->dev_handle = dev_handle;
+	transfer->endpoint = 0;
+	transfer->type = LIBUSB_TRANSFER_TYPE_CONTROL;
+	transfer->timeout = timeout;
+	transfer->buffer = buffer;
+	if (buffer) transfer->length = LIBUSB_CONTROL_SETUP_SIZE + (buffer[6] | (buffer[7] << 8));
+	transfer->user_data = user_data;
+	transfer->callback = callback;
+}
+
+static inline void libusb_fill_interrupt_transfer(struct libusb_transfer *transfer, libusb_device_handle *dev_handle,
+											unsigned char endpoint, unsigned char *buffer, int length,
+											libusb_transfer_cb_fn callback, void *user_data, unsigned int timeout)
+{
+	transfer->dev_handle = dev_handle;
+	transfer->endpoint = endpoint;
+	transfer->type = LIBUSB_TRANSFER_TYPE_INTERRUPT;
+	transfer->timeout = timeout;
+	transfer->buffer = buffer;
+	transfer->length = length;
+	transfer->user_data = user_data;
+	transfer->callback = callback;
+}
+
+static inline unsigned char *libusb_control_transfer_get_data(struct libusb_transfer *transfer)
+{
+	return transfer->buffer + LIBUSB_CONTROL_SETUP_SIZE;
+}
+
+
+// ------------------------------------------------------------------------------
+// - the rest lives in libusb.c
+// ------------------------------------------------------------------------------
+
+extern int		libusb_init						(libusb_context **ctx);
+extern void		libusb_exit						(libusb_context *ctx);
+extern int		libusb_has_capability			(uint32_t capability);
+
+extern ssize_t	libusb_get_device_list			(libusb_context *ctx, libusb_device ***list);
+extern void		libusb_free_device_list			(libusb_device **list, int unref_devices);
+extern int		libusb_get_device_descriptor	(libusb_device *dev, struct libusb_device_descriptor *desc);
+extern uint8_t	libusb_get_bus_number			(libusb_device *dev);
+extern uint8_t	libusb_get_device_address		(libusb_device *dev);
+extern int		libusb_get_port_numbers			(libusb_device *dev, uint8_t *port_numbers, int port_numbers_len);
+
+extern int		libusb_open						(libusb_device *dev, libusb_device_handle **dev_handle);
+extern void		libusb_close					(libusb_device_handle *dev_handle);
+extern libusb_device *libusb_get_device			(libusb_device_handle *dev_handle);
+extern int		libusb_claim_interface			(libusb_device_handle *dev_handle, int interface_number);
+extern int		libusb_release_interface		(libusb_device_handle *dev_handle, int interface_number);
+extern int		libusb_get_string_descriptor_ascii(libusb_device_handle *dev_handle, uint8_t desc_index,
+													unsigned char *data, int length);
+
+extern struct libusb_transfer *libusb_alloc_transfer(int iso_packets);
+extern void		libusb_free_transfer			(struct libusb_transfer *transfer);
+extern int		libusb_submit_transfer			(struct libusb_transfer *transfer);
+extern int		libusb_cancel_transfer			(struct libusb_transfer *transfer);
+
+extern const struct libusb_pollfd **libusb_get_pollfds(libusb_context *ctx);
+extern void		libusb_free_pollfds				(const struct libusb_pollfd **pollfds);
+extern int		libusb_get_next_timeout			(libusb_context *ctx, struct timeval *tv);
+extern int		libusb_handle_events_timeout	(libusb_context *ctx, struct timeval *tv);
+
+extern int		libusb_hotplug_register_callback(libusb_context *ctx, int events, int flags,
+													int vendor_id, int product_id, int dev_class,
+													libusb_hotplug_callback_fn cb_fn, void *user_data,
+													libusb_hotplug_callback_handle *callback_handle);
+extern void		libusb_hotplug_deregister_callback(libusb_context *ctx, libusb_hotplug_callback_handle callback_handle);
+
+#endif /* __gnusbsim_libusb_h_included__ */